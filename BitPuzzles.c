@@ -193,3 +193,725 @@ int weight(int x) {
   
   return x;
 }
+
+
+
+/* ------------------------------------------------- */
+
+
+
+// Batch kernels.
+//
+// The puzzles above, applied to whole arrays at once for bulk jobs. The
+// rules don't apply down here: each kernel has a portable, table-driven
+// version, one that uses the popcnt and rol instructions, and one that
+// uses AVX2, eight elements at a time. The best one the CPU supports is
+// picked when the program starts. All of them give exactly what the
+// puzzle functions would for every element.
+//
+//   gcc -Wall -O2 -DBIT_PUZZLES_BENCH -o bitbench BitPuzzles.c
+//   ./bitbench
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BIT_PUZZLES_X86 1
+#endif
+
+/*
+ * One backend's batch kernels. fitsIn and rotateToTheLeft take a
+ * separate n for each element, within the same bounds as the puzzles.
+ */
+struct BitKernels {
+  const char* name;
+  int (*supported)(void);
+  void (*weight)(const int* x, int* out, size_t count);
+  void (*greaterThan)(const int* x, const int* y, int* out, size_t count);
+  void (*fitsIn)(const int* x, const int* n, int* out, size_t count);
+  void (*canAdd)(const int* x, const int* y, int* out, size_t count);
+  void (*rotateToTheLeft)(const int* x, const int* n, int* out, size_t count);
+};
+
+static int alwaysSupported(void) {
+  return 1;
+}
+
+// The number of ones in each byte value.
+static const unsigned char kByteWeights[256] = {
+#define W2(n) n, n + 1, n + 1, n + 2
+#define W4(n) W2(n), W2(n + 1), W2(n + 1), W2(n + 2)
+#define W6(n) W4(n), W4(n + 1), W4(n + 1), W4(n + 2)
+  W6(0), W6(1), W6(1), W6(2)
+#undef W6
+#undef W4
+#undef W2
+};
+
+// Portable versions. Arithmetic that could overflow is done unsigned.
+
+static void portableWeight(const int* x, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    uint32_t u = (uint32_t) x[i];
+    out[i] = kByteWeights[u & 0xff] + kByteWeights[(u >> 8) & 0xff] +
+             kByteWeights[(u >> 16) & 0xff] + kByteWeights[u >> 24];
+  }
+}
+
+static void portableGreaterThan(const int* x, const int* y, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    out[i] = x[i] > y[i];
+  }
+}
+
+static void portableFitsIn(const int* x, const int* n, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    // What's left of x once its bottom n - 1 bits are gone must be all
+    // sign bits
+    int rest = x[i] >> (n[i] - 1);
+    out[i] = rest == (rest >> 31);
+  }
+}
+
+static void portableCanAdd(const int* x, const int* y, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    // Overflow is when the sum's sign differs from both operands'
+    uint32_t sum = (uint32_t) x[i] + (uint32_t) y[i];
+    out[i] = (((uint32_t) x[i] ^ sum) & ((uint32_t) y[i] ^ sum)) >> 31 ^ 1;
+  }
+}
+
+static void portableRotateToTheLeft(const int* x, const int* n, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    uint32_t u = (uint32_t) x[i];
+    out[i] = (int) (u << n[i] | u >> ((32 - n[i]) & 31));
+  }
+}
+
+#ifdef BIT_PUZZLES_X86
+
+// popcnt and rol. The compare, fit and add kernels have no instruction
+// of their own to use, so they're the portable ones.
+
+static int popcntSupported(void) {
+  return __builtin_cpu_supports("popcnt");
+}
+
+__attribute__((target("popcnt")))
+static void popcntWeight(const int* x, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    out[i] = _mm_popcnt_u32((unsigned int) x[i]);
+  }
+}
+
+static void rolRotateToTheLeft(const int* x, const int* n, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i < count; ++i) {
+    out[i] = (int) _rotl((unsigned int) x[i], n[i]);
+  }
+}
+
+// AVX2, eight elements at a time, finishing with the portable versions.
+
+static int avx2Supported(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+// Counts each nibble's ones by looking it up in a 16-entry table with
+// vpshufb, then adds up the bytes of each 32-bit element.
+__attribute__((target("avx2")))
+static void avx2Weight(const int* x, int* out, size_t count) {
+  const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibbles = _mm256_set1_epi8(0x0f);
+  const __m256i ones8 = _mm256_set1_epi8(1);
+  const __m256i ones16 = _mm256_set1_epi16(1);
+  size_t i;
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (x + i));
+    __m256i low = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibbles));
+    __m256i high = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles));
+    __m256i bytes = _mm256_add_epi8(low, high);
+    __m256i sums = _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, ones8), ones16);
+    _mm256_storeu_si256((__m256i*) (out + i), sums);
+  }
+  portableWeight(x + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2GreaterThan(const int* x, const int* y, int* out, size_t count) {
+  size_t i;
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (y + i));
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_srli_epi32(_mm256_cmpgt_epi32(a, b), 31));
+  }
+  portableGreaterThan(x + i, y + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2FitsIn(const int* x, const int* n, int* out, size_t count) {
+  const __m256i one = _mm256_set1_epi32(1);
+  size_t i;
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x + i));
+    __m256i bits = _mm256_loadu_si256((const __m256i*) (n + i));
+    __m256i rest = _mm256_srav_epi32(a, _mm256_sub_epi32(bits, one));
+    __m256i fits = _mm256_cmpeq_epi32(rest, _mm256_srai_epi32(rest, 31));
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_and_si256(fits, one));
+  }
+  portableFitsIn(x + i, n + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2CanAdd(const int* x, const int* y, int* out, size_t count) {
+  const __m256i one = _mm256_set1_epi32(1);
+  size_t i;
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (y + i));
+    __m256i sum = _mm256_add_epi32(a, b);
+    __m256i overflow = _mm256_and_si256(_mm256_xor_si256(a, sum), _mm256_xor_si256(b, sum));
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_xor_si256(_mm256_srli_epi32(overflow, 31), one));
+  }
+  portableCanAdd(x + i, y + i, out + i, count - i);
+}
+
+// Shifting right by 32 gives 0, so n = 0 needs no special case.
+__attribute__((target("avx2")))
+static void avx2RotateToTheLeft(const int* x, const int* n, int* out, size_t count) {
+  const __m256i width = _mm256_set1_epi32(32);
+  size_t i;
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x + i));
+    __m256i bits = _mm256_loadu_si256((const __m256i*) (n + i));
+    __m256i rotated = _mm256_or_si256(_mm256_sllv_epi32(a, bits),
+                                      _mm256_srlv_epi32(a, _mm256_sub_epi32(width, bits)));
+    _mm256_storeu_si256((__m256i*) (out + i), rotated);
+  }
+  portableRotateToTheLeft(x + i, n + i, out + i, count - i);
+}
+
+#endif // BIT_PUZZLES_X86
+
+// Every backend, fastest last.
+static const struct BitKernels kBitKernels[] = {
+  { "portable", alwaysSupported, portableWeight, portableGreaterThan, portableFitsIn,
+    portableCanAdd, portableRotateToTheLeft },
+#ifdef BIT_PUZZLES_X86
+  { "popcnt", popcntSupported, popcntWeight, portableGreaterThan, portableFitsIn,
+    portableCanAdd, rolRotateToTheLeft },
+  { "avx2", avx2Supported, avx2Weight, avx2GreaterThan, avx2FitsIn,
+    avx2CanAdd, avx2RotateToTheLeft },
+#endif
+};
+
+// A constant expression, so it can size arrays.
+#define BIT_KERNEL_COUNT (sizeof(kBitKernels) / sizeof(kBitKernels[0]))
+
+static const size_t kBitKernelCount = BIT_KERNEL_COUNT;
+
+static const struct BitKernels* bitKernels = &kBitKernels[0];
+
+// Settles on the fastest backend before main() runs, so the batch
+// functions never race to choose one.
+__attribute__((constructor))
+static void pickBitKernels(void) {
+  size_t i;
+  for (i = 0; i < kBitKernelCount; ++i) {
+    if (kBitKernels[i].supported()) {
+      bitKernels = &kBitKernels[i];
+    }
+  }
+}
+
+/*
+ * Set out[i] to weight(x[i]) for every i < count.
+ */
+void weight_batch(const int* x, int* out, size_t count) {
+  bitKernels->weight(x, out, count);
+}
+
+/*
+ * Set out[i] to greaterThan(x[i], y[i]) for every i < count.
+ */
+void greaterThan_batch(const int* x, const int* y, int* out, size_t count) {
+  bitKernels->greaterThan(x, y, out, count);
+}
+
+/*
+ * Set out[i] to fitsIn(x[i], n[i]) for every i < count.
+ */
+void fitsIn_batch(const int* x, const int* n, int* out, size_t count) {
+  bitKernels->fitsIn(x, n, out, count);
+}
+
+/*
+ * Set out[i] to canAdd(x[i], y[i]) for every i < count.
+ */
+void canAdd_batch(const int* x, const int* y, int* out, size_t count) {
+  bitKernels->canAdd(x, y, out, count);
+}
+
+/*
+ * Set out[i] to rotateToTheLeft(x[i], n[i]) for every i < count.
+ */
+void rotateToTheLeft_batch(const int* x, const int* n, int* out, size_t count) {
+  bitKernels->rotateToTheLeft(x, n, out, count);
+}
+
+#ifdef BIT_PUZZLES_BENCH
+
+// Times each backend's kernels against the puzzle functions on random
+// inputs, after checking that they agree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Elements per array, small enough to stay in cache, and passes over them
+// per timing.
+#define BENCH_COUNT (1 << 16)
+#define BENCH_PASSES 200
+
+enum { BENCH_WEIGHT, BENCH_GREATER_THAN, BENCH_FITS_IN, BENCH_CAN_ADD, BENCH_ROTATE, BENCH_KERNELS };
+
+static const char* kBenchNames[BENCH_KERNELS] = {
+  "weight", "greaterThan", "fitsIn", "canAdd", "rotateToTheLeft"
+};
+
+static int benchX[BENCH_COUNT], benchY[BENCH_COUNT];
+static int benchBits[BENCH_COUNT], benchShifts[BENCH_COUNT];
+static int benchExpected[BENCH_KERNELS][BENCH_COUNT];
+static int benchOut[BENCH_COUNT];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift64*, so every run sees the same inputs.
+static uint64_t benchState = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t benchRandom(void) {
+  benchState ^= benchState >> 12;
+  benchState ^= benchState << 25;
+  benchState ^= benchState >> 27;
+  return (uint32_t) ((benchState * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static void referenceBatch(int kernel, int* out) {
+  int i;
+  for (i = 0; i < BENCH_COUNT; ++i) {
+    switch (kernel) {
+    case BENCH_WEIGHT: out[i] = weight(benchX[i]); break;
+    case BENCH_GREATER_THAN: out[i] = greaterThan(benchX[i], benchY[i]); break;
+    case BENCH_FITS_IN: out[i] = fitsIn(benchX[i], benchBits[i]); break;
+    case BENCH_CAN_ADD: out[i] = canAdd(benchX[i], benchY[i]); break;
+    default: out[i] = rotateToTheLeft(benchX[i], benchShifts[i]); break;
+    }
+  }
+}
+
+static void runBatch(const struct BitKernels* k, int kernel, int* out) {
+  switch (kernel) {
+  case BENCH_WEIGHT: k->weight(benchX, out, BENCH_COUNT); break;
+  case BENCH_GREATER_THAN: k->greaterThan(benchX, benchY, out, BENCH_COUNT); break;
+  case BENCH_FITS_IN: k->fitsIn(benchX, benchBits, out, BENCH_COUNT); break;
+  case BENCH_CAN_ADD: k->canAdd(benchX, benchY, out, BENCH_COUNT); break;
+  default: k->rotateToTheLeft(benchX, benchShifts, out, BENCH_COUNT); break;
+  }
+}
+
+// Returns nanoseconds per element, with k NULL for the reference.
+static double timeBatch(const struct BitKernels* k, int kernel) {
+  double start = now();
+  int pass;
+  for (pass = 0; pass < BENCH_PASSES; ++pass) {
+    if (k == NULL) {
+      referenceBatch(kernel, benchOut);
+    } else {
+      runBatch(k, kernel, benchOut);
+    }
+  }
+  return (now() - start) * 1e9 / ((double) BENCH_PASSES * BENCH_COUNT);
+}
+
+int main(void) {
+  int i, kernel;
+  size_t b;
+  for (i = 0; i < BENCH_COUNT; ++i) {
+    // Mostly small numbers of either sign for fitsIn, and some near the
+    // limits for canAdd
+    benchX[i] = (int) benchRandom() >> (benchRandom() & 31);
+    benchY[i] = (int) benchRandom();
+    benchBits[i] = 1 + benchRandom() % 32;
+    benchShifts[i] = benchRandom() % 32;
+  }
+  for (kernel = 0; kernel < BENCH_KERNELS; ++kernel) {
+    referenceBatch(kernel, benchExpected[kernel]);
+  }
+
+  printf("ns per element (speedup over the puzzle function)\n\n");
+  printf("%-16s %10s", "", "reference");
+  for (b = 0; b < kBitKernelCount; ++b) {
+    if (kBitKernels[b].supported()) {
+      printf(" %16s", kBitKernels[b].name);
+    }
+  }
+  printf("\n");
+
+  int failed = 0;
+  for (kernel = 0; kernel < BENCH_KERNELS; ++kernel) {
+    double reference = timeBatch(NULL, kernel);
+    printf("%-16s %10.3f", kBenchNames[kernel], reference);
+    for (b = 0; b < kBitKernelCount; ++b) {
+      const struct BitKernels* k = &kBitKernels[b];
+      if (!k->supported()) {
+        continue;
+      }
+      runBatch(k, kernel, benchOut);
+      for (i = 0; i < BENCH_COUNT && benchOut[i] == benchExpected[kernel][i]; ++i) { }
+      if (i < BENCH_COUNT) {
+        printf(" %16s", "WRONG");
+        failed = 1;
+        continue;
+      }
+      double took = timeBatch(k, kernel);
+      printf(" %7.3f (%5.1fx)", took, reference / took);
+    }
+    printf("\n");
+  }
+  printf("\nbatch functions use %s\n", bitKernels->name);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif // BIT_PUZZLES_BENCH
+
+
+
+/* ------------------------------------------------- */
+
+
+
+// Verification.
+//
+// Checks every puzzle function and batch kernel against a plain
+// definition of what it should compute: the unary ones over every int,
+// and the rest over a random sweep that leans on the edge cases. The
+// work is split across one thread per core. The puzzles rely on signed
+// arithmetic wrapping, hence -fwrapv.
+//
+//   gcc -Wall -O2 -fwrapv -pthread -DBIT_PUZZLES_VERIFY -o bitverify BitPuzzles.c
+//   ./bitverify [millions of random samples [threads]]
+
+#ifdef BIT_PUZZLES_VERIFY
+
+#if defined(BIT_PUZZLES_BENCH)
+#error "BIT_PUZZLES_VERIFY and BIT_PUZZLES_BENCH each have their own main()"
+#endif
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Random samples taken unless told otherwise, and how many inputs are
+// checked at a time.
+#define VERIFY_DEFAULT_MILLIONS 256
+#define VERIFY_BLOCK 4096
+
+static int refAnd(int x, int y) { return x & y; }
+static int refOr(int x, int y) { return x | y; }
+static int refRecognizeTmax(int x) { return x == INT_MAX; }
+static int refRecognizeZero(int x) { return x == 0; }
+static int refGreaterThan(int x, int y) { return x > y; }
+static int refWeight(int x) { return __builtin_popcount((unsigned int) x); }
+
+static int refFitsIn(int x, int n) {
+  int64_t limit = (int64_t) 1 << (n - 1);
+  return -limit <= x && x < limit;
+}
+
+static int refCanAdd(int x, int y) {
+  int64_t sum = (int64_t) x + y;
+  return INT_MIN <= sum && sum <= INT_MAX;
+}
+
+static int refWriteByte(int x, int index, int newByte) {
+  uint32_t shift = 8 * index;
+  return (int) (((uint32_t) x & ~(0xffu << shift)) | (uint32_t) newByte << shift);
+}
+
+static int refRotateToTheLeft(int x, int n) {
+  uint32_t u = (uint32_t) x;
+  return (int) (u << n | u >> ((32 - n) & 31));
+}
+
+// What's been checked of one function, and the first inputs it got
+// wrong.
+struct Tally {
+  const char* name;
+  uint64_t checks;
+  uint64_t failures;
+  int first[3];
+};
+
+// The puzzle functions, then each backend's batch kernels.
+enum {
+  CHECK_AND, CHECK_OR, CHECK_TMAX, CHECK_ZERO, CHECK_FITS_IN, CHECK_CAN_ADD,
+  CHECK_GREATER_THAN, CHECK_WRITE_BYTE, CHECK_ROTATE, CHECK_WEIGHT, CHECK_FUNCTIONS
+};
+enum {
+  BATCH_WEIGHT, BATCH_GREATER_THAN, BATCH_FITS_IN, BATCH_CAN_ADD, BATCH_ROTATE, BATCH_KERNELS
+};
+#define CHECK_ROWS (CHECK_FUNCTIONS + BIT_KERNEL_COUNT * BATCH_KERNELS)
+
+static const char* kCheckNames[CHECK_FUNCTIONS] = {
+  "and", "or", "recognizeTmax", "recognizeZero", "fitsIn", "canAdd",
+  "greaterThan", "writeByte", "rotateToTheLeft", "weight"
+};
+static const char* kBatchNames[BATCH_KERNELS] = {
+  "weight_batch", "greaterThan_batch", "fitsIn_batch", "canAdd_batch", "rotateToTheLeft_batch"
+};
+
+// One thread's share: a range of the ints, some of the random samples,
+// and its own tallies to be added up once it's done.
+struct Worker {
+  pthread_t thread;
+  uint64_t begin, end;
+  uint64_t samples;
+  uint64_t seed;
+  struct Tally tallies[CHECK_ROWS];
+};
+
+static void check(struct Tally* tally, int ok, int a, int b, int c) {
+  ++tally->checks;
+  if (!ok && tally->failures++ == 0) {
+    tally->first[0] = a;
+    tally->first[1] = b;
+    tally->first[2] = c;
+  }
+}
+
+static struct Tally* batchTally(struct Worker* w, size_t backend, int kernel) {
+  return &w->tallies[CHECK_FUNCTIONS + backend * BATCH_KERNELS + kernel];
+}
+
+// Checks the unary functions, and the batch weights, on every int from
+// w->begin up to w->end.
+static void verifyUnary(struct Worker* w) {
+  int xs[VERIFY_BLOCK], out[VERIFY_BLOCK];
+  uint64_t at;
+  size_t b;
+  int i;
+  for (at = w->begin; at < w->end; at += VERIFY_BLOCK) {
+    int count = w->end - at < VERIFY_BLOCK ? (int) (w->end - at) : VERIFY_BLOCK;
+    for (i = 0; i < count; ++i) {
+      int x = (int) (uint32_t) (at + i);
+      xs[i] = x;
+      check(&w->tallies[CHECK_TMAX], recognizeTmax(x) == refRecognizeTmax(x), x, 0, 0);
+      check(&w->tallies[CHECK_ZERO], recognizeZero(x) == refRecognizeZero(x), x, 0, 0);
+      check(&w->tallies[CHECK_WEIGHT], weight(x) == refWeight(x), x, 0, 0);
+    }
+    for (b = 0; b < kBitKernelCount; ++b) {
+      if (!kBitKernels[b].supported()) {
+        continue;
+      }
+      kBitKernels[b].weight(xs, out, count);
+      for (i = 0; i < count; ++i) {
+        check(batchTally(w, b, BATCH_WEIGHT), out[i] == refWeight(xs[i]), xs[i], 0, 0);
+      }
+    }
+  }
+}
+
+// xorshift64*, one per worker.
+static uint32_t nextRandom(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (uint32_t) ((*state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+// Returns a random int, one time in eight an edge case: something
+// within a few of 0, INT_MIN or INT_MAX.
+static int randomOperand(uint64_t* state) {
+  static const int kEdges[] = { 0, 1, -1, INT_MIN, INT_MIN + 1, INT_MAX, INT_MAX - 1 };
+  uint32_t r = nextRandom(state);
+  if ((r & 7) == 0) {
+    return kEdges[(r >> 3) % (sizeof(kEdges) / sizeof(kEdges[0]))];
+  }
+  // Otherwise of a random width, so that small magnitudes turn up too
+  return (int) nextRandom(state) >> (r >> 27);
+}
+
+// Checks the functions of more than one argument, and the batch kernels
+// of two, on w->samples random inputs.
+static void verifySampled(struct Worker* w) {
+  int xs[VERIFY_BLOCK], ys[VERIFY_BLOCK], bits[VERIFY_BLOCK], shifts[VERIFY_BLOCK];
+  int out[VERIFY_BLOCK];
+  uint64_t state = w->seed;
+  uint64_t done;
+  size_t b;
+  int i;
+  for (done = 0; done < w->samples; done += VERIFY_BLOCK) {
+    int count = w->samples - done < VERIFY_BLOCK ? (int) (w->samples - done) : VERIFY_BLOCK;
+    for (i = 0; i < count; ++i) {
+      int x = randomOperand(&state), y = randomOperand(&state);
+      uint32_t r = nextRandom(&state);
+      int n = 1 + (r & 31), shift = (r >> 5) & 31, index = (r >> 10) & 3, newByte = (r >> 12) & 0xff;
+      xs[i] = x;
+      ys[i] = y;
+      bits[i] = n;
+      shifts[i] = shift;
+
+      check(&w->tallies[CHECK_AND], and(x, y) == refAnd(x, y), x, y, 0);
+      check(&w->tallies[CHECK_OR], or(x, y) == refOr(x, y), x, y, 0);
+      check(&w->tallies[CHECK_FITS_IN], fitsIn(x, n) == refFitsIn(x, n), x, n, 0);
+      check(&w->tallies[CHECK_CAN_ADD], canAdd(x, y) == refCanAdd(x, y), x, y, 0);
+      check(&w->tallies[CHECK_GREATER_THAN], greaterThan(x, y) == refGreaterThan(x, y), x, y, 0);
+      check(&w->tallies[CHECK_WRITE_BYTE],
+            writeByte(x, index, newByte) == refWriteByte(x, index, newByte), x, index, newByte);
+      check(&w->tallies[CHECK_ROTATE], rotateToTheLeft(x, shift) == refRotateToTheLeft(x, shift),
+            x, shift, 0);
+    }
+
+    for (b = 0; b < kBitKernelCount; ++b) {
+      const struct BitKernels* k = &kBitKernels[b];
+      if (!k->supported()) {
+        continue;
+      }
+      k->greaterThan(xs, ys, out, count);
+      for (i = 0; i < count; ++i) {
+        check(batchTally(w, b, BATCH_GREATER_THAN), out[i] == refGreaterThan(xs[i], ys[i]),
+              xs[i], ys[i], 0);
+      }
+      k->fitsIn(xs, bits, out, count);
+      for (i = 0; i < count; ++i) {
+        check(batchTally(w, b, BATCH_FITS_IN), out[i] == refFitsIn(xs[i], bits[i]),
+              xs[i], bits[i], 0);
+      }
+      k->canAdd(xs, ys, out, count);
+      for (i = 0; i < count; ++i) {
+        check(batchTally(w, b, BATCH_CAN_ADD), out[i] == refCanAdd(xs[i], ys[i]),
+              xs[i], ys[i], 0);
+      }
+      k->rotateToTheLeft(xs, shifts, out, count);
+      for (i = 0; i < count; ++i) {
+        check(batchTally(w, b, BATCH_ROTATE), out[i] == refRotateToTheLeft(xs[i], shifts[i]),
+              xs[i], shifts[i], 0);
+      }
+    }
+  }
+}
+
+static void* verify(void* arg) {
+  struct Worker* w = arg;
+  verifyUnary(w);
+  verifySampled(w);
+  return NULL;
+}
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t samples = (uint64_t) VERIFY_DEFAULT_MILLIONS * 1000000;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc > 3 || (argc >= 2 && (samples = strtoull(argv[1], NULL, 10) * 1000000) == 0) ||
+      (argc == 3 && (threads = atol(argv[2])) <= 0)) {
+    fprintf(stderr, "Usage: ./bitverify [millions of random samples [threads]]\n");
+    return EXIT_FAILURE;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  struct Worker* workers = calloc(threads, sizeof(struct Worker));
+  if (workers == NULL) {
+    return EXIT_FAILURE;
+  }
+  printf("Checking every int and %llu random samples on %ld threads\n\n",
+         (unsigned long long) samples, threads);
+
+  double start = seconds();
+  long t;
+  for (t = 0; t < threads; ++t) {
+    struct Worker* w = &workers[t];
+    w->begin = ((uint64_t) 1 << 32) * t / threads;
+    w->end = ((uint64_t) 1 << 32) * (t + 1) / threads;
+    w->samples = samples * (t + 1) / threads - samples * t / threads;
+    w->seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+    if (pthread_create(&w->thread, NULL, verify, w) != 0) {
+      fprintf(stderr, "Couldn't start a thread\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct Tally totals[CHECK_ROWS] = { { 0 } };
+  char names[CHECK_ROWS][64];
+  size_t row;
+  for (row = 0; row < CHECK_ROWS; ++row) {
+    if (row < CHECK_FUNCTIONS) {
+      snprintf(names[row], sizeof(names[row]), "%s", kCheckNames[row]);
+    } else {
+      size_t batch = row - CHECK_FUNCTIONS;
+      size_t b = batch / BATCH_KERNELS;
+      snprintf(names[row], sizeof(names[row]), "%s (%s)", kBatchNames[batch % BATCH_KERNELS],
+               kBitKernels[b].name);
+    }
+    totals[row].name = names[row];
+  }
+  for (t = 0; t < threads; ++t) {
+    pthread_join(workers[t].thread, NULL);
+    for (row = 0; row < CHECK_ROWS; ++row) {
+      const struct Tally* tally = &workers[t].tallies[row];
+      if (tally->failures != 0 && totals[row].failures == 0) {
+        totals[row].first[0] = tally->first[0];
+        totals[row].first[1] = tally->first[1];
+        totals[row].first[2] = tally->first[2];
+      }
+      totals[row].checks += tally->checks;
+      totals[row].failures += tally->failures;
+    }
+  }
+  double elapsed = seconds() - start;
+
+  uint64_t checks = 0, failures = 0;
+  printf("%-32s %12s %10s  %s\n", "function", "checks", "failures", "first failure");
+  for (row = 0; row < CHECK_ROWS; ++row) {
+    const struct Tally* tally = &totals[row];
+    if (tally->checks == 0) {
+      continue;
+    }
+    printf("%-32s %12llu %10llu", tally->name, (unsigned long long) tally->checks,
+           (unsigned long long) tally->failures);
+    if (tally->failures != 0) {
+      printf("  (%d, %d, %d)", tally->first[0], tally->first[1], tally->first[2]);
+    }
+    printf("\n");
+    checks += tally->checks;
+    failures += tally->failures;
+  }
+  printf("\n%llu checks in %.1f s, %.3g checks/s\n", (unsigned long long) checks, elapsed,
+         checks / elapsed);
+
+  free(workers);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif // BIT_PUZZLES_VERIFY
@@ -8,14 +8,24 @@
 // Makefile:
 
 // all:
-//   g++ -Wall -std=gnu++0x -g -o ex12 *.cc
+//   g++ -Wall -std=c++17 -O2 -g -pthread -o ex12 SentenceBuilder.cc BackoffModel.cc SuffixModel.cc CompactModel.cc ModelCache.cc SentenceServer.cc ex12.cc
+
+// bench:
+//   g++ -Wall -std=c++17 -O2 -g -pthread -o ex12bench SentenceBuilder.cc BackoffModel.cc SuffixModel.cc CompactModel.cc bench.cc
+//   ./ex12bench 3 ./datafiles/subset/hugo.txt
+//   ./ex12bench compact 3 ./datafiles/subset/hugo.txt
+//   ./ex12bench suite
 
 // clean:
-//   rm ex12 ex12_isaacr.tar.gz
+//   rm ex12 ex12bench ex12_isaacr.tar.gz
 
 // run:
 //   ./ex12 3 ./datafiles/subset/
 
+// serve:
+//   ./ex12 -p 5050 3 ./datafiles/subset/
+//   ./ex12 -t compact -p 5050 3 ./datafiles/subset/
+
 // test:
 //   ./ex12 2 ./smalldatafiles
 
@@ -41,341 +51,5384 @@
 #include <fstream>
 #include <assert.h>
 #include <map>
+#include <unordered_map>
 #include <sstream>
+#include <iomanip>
 #include <vector>
 #include <iostream>
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 #include "SentenceBuilder.h"
 
-string vecToString(vector<string> tokens);
+string vecToString(const vector<TokenId>& tokens, const TokenDictionary& dict);
+vector<string_view> splitSentences(const char* data, size_t size);
 
 //======================================================================
 // SentenceBuilder
 //
 
-// unique_ptr<Gram> _root;
 // uint32_t _n;
+// FrozenModel _frozen;
+// FrozenStorage _storage;
+// unique_ptr<MappedFile> _snapshot;
+// unique_ptr<GramTable> _table;
+// mutable atomic<bool> _stale;
+// mutable mutex _freezing;
+// SentenceBuilderStats _counts;
+// mutable atomic<uint64_t> _generated;
+// mutable atomic<uint64_t> _generatedTokens;
+// mutable atomic<uint64_t> _generateNanos;
+
+SentenceBuilder::SentenceBuilder(string& filename, uint32_t n) : SentenceBuilder(n) {
+    assert(n > 0);
+
+    // Map the file; tokens are read in place from the mapped bytes
+    MappedFile inputFile(filename);
+    assert(inputFile.is_open());
+
+    GramTable table;
+    ingestText(table, inputFile.data(), inputFile.size());
+
+    // Lay the graph out flat for generation. Its nodes and words are
+    // freed along with the table.
+    freeze(table);
+}
 
-SentenceBuilder::SentenceBuilder(string& filename, uint32_t n) : _root(new Gram()), _n(n) {
+void SentenceBuilder::addText(string_view text) {
+    if (!_table) {
+        thaw();
+    }
+    ingestText(*_table, text.data(), text.size());
+    _stale.store(true, memory_order_release);
+}
+
+// Lays the table out again if addText() has changed it since, which
+// costs as much as the whole model, so a run of addText() calls pays
+// for it once. Readers that find it stale wait while the first of them
+// freezes it.
+const FrozenModel& SentenceBuilder::model() const {
+    if (_stale.load(memory_order_acquire)) {
+        lock_guard<mutex> lock(_freezing);
+        if (_stale.load(memory_order_relaxed)) {
+            const_cast<SentenceBuilder*>(this)->freeze(*_table);
+            _stale.store(false, memory_order_release);
+        }
+    }
+    return _frozen;
+}
+
+bool SentenceBuilder::addFile(const string& filename) {
+    MappedFile inputFile(filename);
+    if (!inputFile.is_open()) {
+        return false;
+    }
+    addText(string_view(inputFile.data(), inputFile.size()));
+    return true;
+}
 
-    // Open file
-    fstream inputFile;
-    inputFile.open(filename, ios::in);
+template <uint32_t N>
+SentenceBuilderN<N>::SentenceBuilderN(string& filename) : SentenceBuilder(N) {
+    MappedFile inputFile(filename);
     assert(inputFile.is_open());
 
-    // Stores existing grams
-    map<string, shared_ptr<Gram> > grams;
-    vector<string> tokens;
+    BasicGramTable<FixedKeys<N> > table;
+    ingestText(table, inputFile.data(), inputFile.size());
+    freeze(table);
+}
+
+template class SentenceBuilderN<2>;
+template class SentenceBuilderN<3>;
+
+shared_ptr<SentenceBuilder> SentenceBuilder::create(string& filename, uint32_t n) {
+    switch (n) {
+    case 2:
+        return make_shared<SentenceBuilderN<2> >(filename);
+    case 3:
+        return make_shared<SentenceBuilderN<3> >(filename);
+    default:
+        return make_shared<SentenceBuilder>(filename, n);
+    }
+}
+
+template <class Table>
+void SentenceBuilder::ingestText(Table& table, const char* data, size_t size) {
+    // Big texts are split at sentence boundaries and each piece is
+    // turned into grams on its own thread
+    vector<string_view> chunks = ::splitSentences(data, size);
+    if (chunks.size() == 1) {
+        TokenStream stream(data, size);
+        ingest(table, stream);
+        takeCounts(table);
+        return;
+    }
+
+    vector<Table> tables(chunks.size());
+    parallelFor(chunks.size(), [&](size_t i) {
+        TokenStream stream(chunks[i].data(), chunks[i].size());
+        ingest(tables[i], stream);
+    });
+
+    // Then fold the pieces into table. Each piece started at the
+    // beginning of a sentence, so the result has exactly the grams and
+    // counts a single pass over the text would have.
+    uint32_t i;
+    for (i = 0; i < tables.size(); ++i) {
+        table.merge(tables[i]);
+    }
+    takeCounts(table);
+}
+
+// Moves what ingesting did to table into this model's counters.
+template <class Table>
+void SentenceBuilder::takeCounts(Table& table) {
+    _counts._tokens += table._tokens;
+    _counts._sentences += table._sentences;
+    _counts._hits += table._hits;
+    _counts._misses += table._misses;
+    table._tokens = table._sentences = table._hits = table._misses = 0;
+}
+
+// Rebuilds the grams and edges of m in table, which must be empty, with
+// every count multiplied by weight.
+static void thawInto(const FrozenModel& m, GramTable& table, uint32_t weight) {
+    // Words keep their IDs, since they're interned in ID order
+    uint32_t i;
+    for (i = 0; i < m._wordCount; ++i) {
+        table._dict.intern(m.word(i));
+    }
+
+    vector<Gram*> grams(m._gramCount);
+    grams[0] = table._root;
+    vector<TokenId> tokens;
+    uint32_t g;
+    for (g = 1; g < m._gramCount; ++g) {
+        const TokenId* gramTokens = m._gramTokens + g * m._n;
+        tokens.clear();
+        for (i = 0; i < m._n && gramTokens[i] != kNoToken; ++i) {
+            tokens.push_back(gramTokens[i]);
+        }
+        grams[g] = table.GetDefaultOrAdd(tokens);
+    }
+
+    // Counts come back out of the running totals
+    for (g = 0; g < m._gramCount; ++g) {
+        uint32_t total = 0;
+        for (i = m._edgeOffsets[g]; i < m._edgeOffsets[g + 1]; ++i) {
+            const FrozenEdge& edge = m._edges[i];
+            uint64_t count = uint64_t(edge._cumulative - total) * weight;
+            assert(count <= UINT32_MAX);
+            grams[g]->addEdge(grams[edge._target], count);
+            total = edge._cumulative;
+        }
+    }
+
+    // Rebuilding the index isn't reading text
+    table._hits = table._misses = 0;
+}
+
+// Returns the largest sum of the counts of one gram's edges in m.
+static uint32_t largestTotal(const FrozenModel& m) {
+    uint32_t most = 0;
+    uint32_t g;
+    for (g = 0; g < m._gramCount; ++g) {
+        if (m._edgeOffsets[g] != m._edgeOffsets[g + 1]) {
+            most = max(most, m._edges[m._edgeOffsets[g + 1] - 1]._cumulative);
+        }
+    }
+    return most;
+}
+
+void SentenceBuilder::thaw() {
+    _table.reset(new GramTable());
+    thawInto(_frozen, *_table, 1);
+}
+
+shared_ptr<SentenceBuilder> SentenceBuilder::merge(const vector<const SentenceBuilder*>& models,
+                                                   const vector<uint32_t>& weights) {
+    assert(weights.empty() || weights.size() == models.size());
+    if (models.empty()) {
+        return shared_ptr<SentenceBuilder>(NULL);
+    }
+    uint32_t n = models[0]->_n;
+    size_t i;
+    for (i = 1; i < models.size(); ++i) {
+        if (models[i]->_n != n) {
+            return shared_ptr<SentenceBuilder>(NULL);
+        }
+    }
+
+    // Each merged gram's total is at most the weighted sum of the
+    // largest in each model, and has to fit its counts' 32 bits
+    uint64_t most = 0;
+    for (i = 0; i < models.size(); ++i) {
+        uint32_t weight = weights.empty() ? 1 : weights[i];
+        assert(weight > 0);
+        most += uint64_t(weight) * largestTotal(models[i]->model());
+        if (most > UINT32_MAX) {
+            return shared_ptr<SentenceBuilder>(NULL);
+        }
+    }
+
+    vector<GramTable> tables(models.size());
+    parallelFor(models.size(), [&](size_t i) {
+        thawInto(models[i]->model(), tables[i], weights.empty() ? 1 : weights[i]);
+    });
+
+    // Fold the tables together in pairs, a round at a time, until
+    // they're all in the first. The pairs in each round are independent.
+    size_t step;
+    for (step = 1; step < tables.size(); step *= 2) {
+        parallelFor((tables.size() + 2 * step - 1) / (2 * step), [&](size_t i) {
+            size_t into = 2 * step * i;
+            if (into + step < tables.size()) {
+                tables[into].merge(tables[into + step]);
+            }
+        });
+    }
+
+    shared_ptr<SentenceBuilder> merged(new SentenceBuilder(n));
+    for (i = 0; i < models.size(); ++i) {
+        merged->_counts._tokens += models[i]->_counts._tokens;
+        merged->_counts._sentences += models[i]->_counts._sentences;
+        merged->_counts._hits += models[i]->_counts._hits;
+        merged->_counts._misses += models[i]->_counts._misses;
+    }
+    merged->freeze(tables[0]);
+    return merged;
+}
+
+template <class Table>
+void SentenceBuilder::ingest(Table& table, TokenStream& stream) {
+    TokenWindow window(_n);
 
     // Start the sentence
-    shared_ptr<Gram> prev = startSentence(grams, inputFile);
+    Gram* prev = startSentence(table, stream);
     if (prev == NULL) {
-        inputFile.close();
         return;
     }
-    tokens = prev->_tokens;
-    _root->_children.push_back(prev);
+    window.reset(prev->_tokens);
 
     // Create the rest of the n-grams
-    string text;
+    string_view text;
+    bool ends;
     while (true) {
         // Modify tokens to hold the next gram
-        inputFile >> text;
-        if (text == "" || !inputFile.good()) break;
-        tokens.erase(tokens.begin());
-        tokens.push_back(text);
+        if (!stream.next(text, ends)) break;
+        if (kCollectStats) {
+            ++table._tokens;
+            table._sentences += ends;
+        }
+        window.push(table._dict.intern(text));
 
         // Add the current node if necessary, then add this edge
-        shared_ptr<Gram> nextGram = GetDefaultOrAdd(grams, tokens);
-        //cout << prev->to_str() << "--> " << nextGram->to_str() << endl;
-        prev->_children.push_back(nextGram);
+        Gram* nextGram = table.GetDefaultOrAdd(window.view(), window.hash());
+        //cout << prev->to_str(table._dict) << "--> " << nextGram->to_str(table._dict) << endl;
+        prev->addEdge(nextGram);
         prev = nextGram;
 
-        if (text.find('.') != string::npos) {
-            prev = startSentence(grams, inputFile);
+        if (ends) {
+            prev = startSentence(table, stream);
             if (prev == NULL) {
                 break;
             }            
-            tokens = prev->_tokens;
+            window.reset(prev->_tokens);
         }
     }
-
-    inputFile.close();
 }
 
-shared_ptr<Gram> SentenceBuilder::startSentence(
-                                map<string, shared_ptr<Gram> >& grams,
-                                fstream& file) {
+template <class Table>
+Gram* SentenceBuilder::startSentence(Table& table, TokenStream& stream) {
 
-    vector<string> tokens;
-    string text;
+    vector<TokenId> tokens;
+    uint64_t hash;
+    string_view text;
+    bool ends;
 
-    shared_ptr<Gram> prev = _root;
+    // Each pass tries to extract the leading n-gram of one sentence. A
+    // sentence that ends before reaching n tokens just starts the next
+    // pass, so runs of short sentences don't grow the stack.
+    while (true) {
+        tokens.clear();
+        hash = 0;
+        Gram* prev = table._root;
 
-    // Extract the leading n-gram
-    uint32_t i = 0;
-    while (i < _n) {
-        file >> text;
+        while (tokens.size() < _n) {
+            // End of file before reaching n!
+            if (!stream.next(text, ends)) {
+                return NULL;
+            }
+            if (kCollectStats) {
+                ++table._tokens;
+                table._sentences += ends;
+            }
 
-        // End of file OR end of sentence (either way, before reaching n!)
-        if (text == "" || !file.good() || text.find('.') != string::npos) {
-            break;
-        }
-        
-        tokens.push_back(text);
-        ++i;
+            // End of sentence before reaching n!
+            if (ends) {
+                break;
+            }
 
-        // For each token we add to the beginning of this sentence,
-        // add a node to the graph.
-        shared_ptr<Gram> next = GetDefaultOrAdd(grams, tokens);
-        prev->_children.push_back(next);
+            TokenId token = table._dict.intern(text);
+            tokens.push_back(token);
+            hash = hash * TokenIdsHash::kBase + token + 1;
 
-        //cout << prev->to_str() << "--> " << next->to_str() <<  endl;
-        prev = next;
-    }
-    
-    // Under what circumstances did we stop adding to this n-gram?
-    if (i == _n) {
-        return prev;
-    } else if (!file.good()) {
-        return shared_ptr<Gram>(NULL);
-    } else { // text.find('.') != string::npos
-        return startSentence(grams, file);
-    }
-}
-
-shared_ptr<Gram> SentenceBuilder::GetDefaultOrAdd(
-                                map<string, shared_ptr<Gram> >& grams,
-                                vector<string> tokens) {
-    shared_ptr<Gram> gram;
-    string s = ::vecToString(tokens);
-    if (grams.find(s) != grams.end()) {
-        gram = grams[s];
-    } else {
-        gram = shared_ptr<Gram>(new Gram());
-        gram->_tokens = tokens;
-        pair<string, shared_ptr<Gram> > pair(gram->to_str(), gram);
-        grams.insert(pair);
+            // For each token we add to the beginning of this sentence,
+            // add a node to the graph.
+            Gram* next = table.GetDefaultOrAdd(
+                TokenSpan(tokens.data(), tokens.size()), hash);
+            prev->addEdge(next);
+
+            //cout << prev->to_str(table._dict) << "--> " << next->to_str(table._dict) <<  endl;
+            prev = next;
+        }
+
+        if (tokens.size() == _n) {
+            return prev;
+        }
     }
-    return gram;
 }
 
-SentenceBuilder::~SentenceBuilder() {
-    vector<shared_ptr<Gram> > grams;
-    recursiveDelete(grams, _root);
-}
+SentenceBuilder::SentenceBuilder(uint32_t n)
+    : _n(n), _stale(false), _counts(), _generated(0), _generatedTokens(0), _generateNanos(0) { }
 
-void SentenceBuilder::recursiveDelete(vector<shared_ptr<Gram> >& grams,
-                                      shared_ptr<Gram> curr) {
-    //cout << "Adding " << ::vecToString(curr->_tokens) << endl;
-    grams.push_back(curr);
+SentenceBuilder::~SentenceBuilder() { }
 
-    vector<shared_ptr<Gram> > ptrs = curr->_children;
-    curr->_children.clear();
-    uint32_t i;
-    for (i = 0; i < ptrs.size(); ++i) {
-        recursiveDelete(grams, ptrs[i]);
+string SentenceBuilder::buildSentence(const WalkLimits& limits) const {
+    // Each thread draws from its own generator, so concurrent calls
+    // share nothing mutable
+    thread_local Xoshiro256 random(random_device{}());
+
+    chrono::steady_clock::time_point start;
+    if (kCollectStats) {
+        start = chrono::steady_clock::now();
+    }
+
+    string sentence;
+    StringSink sink(sentence);
+    uint32_t words = walk(random, sink, limits);
+
+    if (kCollectStats) {
+        countGenerated(1, words, start);
     }
+    return sentence;
 }
 
-string SentenceBuilder::buildSentence() {
-    stringstream ss;
-    shared_ptr<Gram> curr = _root->_children[rand() % _root->_children.size()];
-    
-    while (curr->_children.size() > 0) {
-        ss << curr->_tokens[curr->_tokens.size() - 1] << " ";
-        uint32_t randIndex = rand() % curr->_children.size();
-        curr = curr->_children[randIndex];
+void SentenceBuilder::buildSentences(size_t count, Xoshiro256& random, string& out,
+                                     const WalkLimits& limits) const {
+    chrono::steady_clock::time_point start;
+    if (kCollectStats) {
+        start = chrono::steady_clock::now();
+    }
+
+    StringSink sink(out);
+    uint64_t words = 0;
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        words += walk(random, sink, limits);
+        out += '\n';
+    }
+
+    if (kCollectStats) {
+        countGenerated(count, words, start);
     }
-    ss << curr->_tokens[curr->_tokens.size() - 1] << " ";
-    
-    return ss.str();
 }
 
-//======================================================================
-// Gram
-//
+uint32_t SentenceBuilder::writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                                        const WalkLimits& limits) const {
+    return streamSentence(random, sink, limits);
+}
 
-// vector<string> _tokens;
-// vector<shared_ptr<Gram> > _children;
+void SentenceBuilder::countGenerated(uint64_t sentences, uint64_t words,
+                                     chrono::steady_clock::time_point start) const {
+    chrono::nanoseconds took = chrono::steady_clock::now() - start;
+    _generated.fetch_add(sentences, memory_order_relaxed);
+    _generatedTokens.fetch_add(words, memory_order_relaxed);
+    _generateNanos.fetch_add(took.count(), memory_order_relaxed);
+}
 
-Gram::~Gram() {
-    //cout << "Here with " << ::vecToString(_tokens) << endl;
-    _children.clear();
+uint32_t SentenceBuilder::n() const {
+    return _n;
 }
 
-string Gram::to_str() {
-    return ::vecToString(_tokens);
+// The root isn't a gram of the text.
+uint64_t SentenceBuilder::gramCount() const {
+    return model()._gramCount - 1;
 }
 
+uint64_t SentenceBuilder::edgeCount() const {
+    return model()._edgeCount;
+}
 
-//======================================================================
-// Helpers
-//
+const FrozenModel& SentenceBuilder::frozen() const {
+    return model();
+}
 
-string vecToString(vector<string> tokens) {
-    stringstream ss;
-    uint32_t i;
-    for (i = 0; i < tokens.size(); ++i) {
-        ss << tokens[i] << " ";
+SentenceBuilderStats SentenceBuilder::stats() const {
+    const FrozenModel& m = model();
+    SentenceBuilderStats stats = _counts;
+    stats._grams = gramCount();
+    stats._edges = edgeCount();
+    stats._maxOutDegree = 0;
+    uint64_t g;
+    for (g = 0; g < m._gramCount; ++g) {
+        stats._maxOutDegree = max<uint64_t>(stats._maxOutDegree,
+                                            m._edgeOffsets[g + 1] - m._edgeOffsets[g]);
     }
-    return ss.str();
+    stats._bytes = memoryUsage();
+    stats._generated = _generated.load(memory_order_relaxed);
+    stats._generatedTokens = _generatedTokens.load(memory_order_relaxed);
+    stats._generateNanos = _generateNanos.load(memory_order_relaxed);
+    return stats;
 }
 
+string SentenceBuilder::describe() const {
+    return stats().to_str();
+}
 
+size_t SentenceBuilder::memoryUsage() const {
+    model();
+    size_t bytes = sizeof(*this);
+    if (_snapshot) {
+        bytes += _snapshot->size();
+    } else {
+        bytes += _storage._wordOffsets.capacity() * sizeof(uint64_t) +
+                 _storage._wordChars.capacity() +
+                 _storage._gramTokens.capacity() * sizeof(TokenId) +
+                 _storage._edgeOffsets.capacity() * sizeof(uint32_t) +
+                 _storage._edges.capacity() * sizeof(FrozenEdge) +
+                 _storage._endDistances.capacity() * sizeof(uint32_t);
+    }
+    if (_table) {
+        bytes += _table->memoryUsage();
+    }
+    return bytes;
+}
 
+// Sets distances[g] to the fewest edges from gram g to a gram with none,
+// or kNeverEnds if there's no such path, by searching breadth-first
+// backwards from the grams with none.
+static void findEndDistances(const vector<uint32_t>& offsets, const vector<FrozenEdge>& edges,
+                             vector<uint32_t>& distances) {
+    uint32_t grams = offsets.size() - 1;
+    uint32_t g, e;
 
+    // The edges into each gram, as the gram numbers they come from
+    vector<uint32_t> intoOffsets(grams + 1, 0);
+    for (e = 0; e < edges.size(); ++e) {
+        ++intoOffsets[edges[e]._target + 1];
+    }
+    for (g = 0; g < grams; ++g) {
+        intoOffsets[g + 1] += intoOffsets[g];
+    }
+    vector<uint32_t> into(edges.size());
+    vector<uint32_t> filled(intoOffsets.begin(), intoOffsets.end() - 1);
+    for (g = 0; g < grams; ++g) {
+        for (e = offsets[g]; e < offsets[g + 1]; ++e) {
+            into[filled[edges[e]._target]++] = g;
+        }
+    }
 
-/* ------------------------------------------------- */
+    distances.assign(grams, kNeverEnds);
+    vector<uint32_t> queue;
+    for (g = 0; g < grams; ++g) {
+        if (offsets[g] == offsets[g + 1]) {
+            distances[g] = 0;
+            queue.push_back(g);
+        }
+    }
+    size_t i;
+    for (i = 0; i < queue.size(); ++i) {
+        g = queue[i];
+        for (e = intoOffsets[g]; e < intoOffsets[g + 1]; ++e) {
+            if (distances[into[e]] == kNeverEnds) {
+                distances[into[e]] = distances[g] + 1;
+                queue.push_back(into[e]);
+            }
+        }
+    }
+}
 
+template <class Table>
+void SentenceBuilder::freeze(const Table& table) {
+    // Number the grams breadth-first from the root, which is gram 0, so
+    // that grams that follow each other tend to be close together
+    vector<Gram*> order;
+    unordered_map<Gram*, uint32_t> index;
+    order.push_back(table._root);
+    index[table._root] = 0;
+    uint32_t g, i;
+    for (g = 0; g < order.size(); ++g) {
+        const vector<Edge>& edges = order[g]->_edges;
+        for (i = 0; i < edges.size(); ++i) {
+            Gram* target = edges[i]._target;
+            if (index.insert(pair<Gram*, uint32_t>(target, order.size())).second) {
+                order.push_back(target);
+            }
+        }
+    }
 
+    // Replaces whatever model this was, including a mapped snapshot
+    FrozenStorage& st = _storage;
+    st = FrozenStorage();
+    st._wordOffsets.assign(1, 0);
+    for (i = 0; i < table._dict.size(); ++i) {
+        st._wordChars += table._dict.word(i);
+        st._wordOffsets.push_back(st._wordChars.size());
+    }
 
+    st._gramTokens.assign(order.size() * _n, kNoToken);
+    st._edgeOffsets.assign(1, 0);
+    for (g = 0; g < order.size(); ++g) {
+        const Gram* gram = order[g];
+        copy(gram->_tokens.begin(), gram->_tokens.end(), st._gramTokens.begin() + g * _n);
 
+        uint32_t total = 0;
+        for (i = 0; i < gram->_edges.size(); ++i) {
+            const Edge& edge = gram->_edges[i];
+            FrozenEdge frozen;
+            total += edge._count;
+            frozen._cumulative = total;
+            frozen._target = index[edge._target];
+            frozen._token = edge._target->_tokens.back();
+            st._edges.push_back(frozen);
+        }
+        assert(st._edges.size() <= UINT32_MAX);
+        st._edgeOffsets.push_back(st._edges.size());
+    }
+    findEndDistances(st._edgeOffsets, st._edges, st._endDistances);
 
+    FrozenModel& m = _frozen;
+    m._n = _n;
+    m._wordCount = table._dict.size();
+    m._gramCount = order.size();
+    m._edgeCount = st._edges.size();
+    m._wordOffsets = st._wordOffsets.data();
+    m._wordChars = st._wordChars.data();
+    m._gramTokens = st._gramTokens.data();
+    m._edgeOffsets = st._edgeOffsets.data();
+    m._edges = st._edges.data();
+    m._endDistances = st._endDistances.data();
+    _snapshot.reset();
+}
 
-#ifndef SENTENCE_BUILDER_HEADER
-#define SENTENCE_BUILDER_HEADER
+//======================================================================
+// Snapshots
+//
 
-#include <string>
-#include <vector>
-#include <memory>
+// A snapshot is a SnapshotHeader followed by the arrays of a
+// FrozenModel, in the order they're declared there. Every array starts
+// on an 8-byte boundary. Numbers are stored in native byte order, so
+// snapshots are only meant to be read on the machine that wrote them.
 
-using namespace std;
+static const char kSnapshotMagic[8] = { 'S', 'B', 'M', 'O', 'D', 'E', 'L', '\0' };
+static const uint32_t kSnapshotVersion = 4;
 
-// Represents a particular N-gram.
-class Gram {
-public:
-    vector<string> _tokens;
-    vector<shared_ptr<Gram> > _children;
-    
-    ~Gram();
-    string to_str();
-};
+// Models built with other tokenizer rules are different models.
+static const uint32_t kSnapshotRules = Boundary::kId << 16 | Normalization::kId;
 
-// Represents a class that parses a file, extracts N-grams (for
-// variable N) from it, and can generate random sentences based on these
-// N-grams.
-class SentenceBuilder {
-  private:
-    shared_ptr<Gram> _root;
+struct SnapshotHeader {
+    char _magic[8];
+    uint32_t _version;
     uint32_t _n;
+    uint32_t _rules;        // The Boundary and Normalization the model was built with
+    uint64_t _wordCount;
+    uint64_t _wordBytes;
+    uint64_t _gramCount;
+    uint64_t _edgeCount;
+};
 
-    shared_ptr<Gram> startSentence(map<string, shared_ptr<Gram> >& grams, fstream& file);
-    shared_ptr<Gram> GetDefaultOrAdd(map<string, shared_ptr<Gram> >& grams, vector<string> tokens);
-    void recursiveDelete(vector<shared_ptr<Gram> >& grams, shared_ptr<Gram> curr);
-    
-  public:
-    // Constructs a SentenceBuilder for a given file. The
-    // SentenceBuilder will track n-grams of length n.
-    SentenceBuilder(string& filename, uint32_t n);
-    ~SentenceBuilder();
+static size_t padded(size_t bytes) {
+    return (bytes + 7) & ~size_t(7);
+}
 
-    // Generates a returns a random sentence. The random sentence
-    // contains only n-grams from the given file. 
-    string buildSentence();
+// Byte offsets of each array in a snapshot with the given header.
+struct SnapshotLayout {
+    size_t _wordOffsets, _wordChars, _gramTokens, _edgeOffsets, _edges, _endDistances, _end;
+
+    SnapshotLayout(const SnapshotHeader& h) {
+        _wordOffsets = padded(sizeof(SnapshotHeader));
+        _wordChars = _wordOffsets + padded((h._wordCount + 1) * sizeof(uint64_t));
+        _gramTokens = _wordChars + padded(h._wordBytes);
+        _edgeOffsets = _gramTokens + padded(h._gramCount * h._n * sizeof(TokenId));
+        _edges = _edgeOffsets + padded((h._gramCount + 1) * sizeof(uint32_t));
+        _endDistances = _edges + padded(h._edgeCount * sizeof(FrozenEdge));
+        _end = _endDistances + padded(h._gramCount * sizeof(uint32_t));
+    }
 };
 
-#endif // SENTENCE_BUILDER_HEADER
+// Returns true if a header's counts are small enough to lay out in
+// size bytes without overflowing, and to number with 32 bits.
+static bool plausible(const SnapshotHeader& h, size_t size) {
+    return h._n > 0 && h._n <= size / sizeof(TokenId) &&
+           h._wordCount < kNoToken && h._wordCount < size / sizeof(uint64_t) &&
+           h._wordBytes <= size &&
+           h._gramCount > 0 && h._gramCount <= UINT32_MAX &&
+           h._gramCount <= size / (h._n * sizeof(TokenId)) &&
+           h._edgeCount <= UINT32_MAX && h._edgeCount <= size / sizeof(FrozenEdge);
+}
 
+// Returns true if every offset, gram number and token ID in m is in
+// range, and walks can't go wrong: running totals rise, and every gram
+// with edges but an end distance has one that's closer to an end.
+static bool consistent(const FrozenModel& m) {
+    uint64_t i;
+    if (m._wordOffsets[0] != 0) {
+        return false;
+    }
+    for (i = 0; i < m._wordCount; ++i) {
+        if (m._wordOffsets[i + 1] < m._wordOffsets[i]) {
+            return false;
+        }
+    }
 
+    for (i = 0; i < m._gramCount * m._n; ++i) {
+        if (m._gramTokens[i] >= m._wordCount && m._gramTokens[i] != kNoToken) {
+            return false;
+        }
+    }
 
+    if (m._edgeOffsets[0] != 0 || m._edgeOffsets[m._gramCount] != m._edgeCount) {
+        return false;
+    }
+    uint32_t g;
+    for (g = 0; g < m._gramCount; ++g) {
+        uint32_t begin = m._edgeOffsets[g], end = m._edgeOffsets[g + 1];
+        if (end < begin) {
+            return false;
+        }
+        uint32_t distance = m._endDistances[g];
+        bool closer = false;
+        uint32_t total = 0;
+        for (i = begin; i < end; ++i) {
+            const FrozenEdge& edge = m._edges[i];
+            if (edge._cumulative <= total || edge._target >= m._gramCount ||
+                edge._token >= m._wordCount) {
+                return false;
+            }
+            total = edge._cumulative;
+            closer |= m._endDistances[edge._target] < distance;
+        }
+        if ((begin == end) != (distance == 0) || (begin != end && distance != kNeverEnds && !closer)) {
+            return false;
+        }
+    }
+    return true;
+}
 
+static void writeArray(ofstream& out, const void* data, size_t bytes) {
+    static const char zeros[8] = { 0 };
+    out.write(static_cast<const char*>(data), bytes);
+    out.write(zeros, padded(bytes) - bytes);
+}
 
-/* ------------------------------------------------- */
+bool SentenceBuilder::save(const string& filename) const {
+    const FrozenModel& m = model();
 
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header._magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header._version = kSnapshotVersion;
+    header._n = m._n;
+    header._rules = kSnapshotRules;
+    header._wordCount = m._wordCount;
+    header._wordBytes = m._wordOffsets[m._wordCount];
+    header._gramCount = m._gramCount;
+    header._edgeCount = m._edgeCount;
 
+    ofstream out(filename, ios::out | ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    writeArray(out, &header, sizeof(header));
+    writeArray(out, m._wordOffsets, (m._wordCount + 1) * sizeof(uint64_t));
+    writeArray(out, m._wordChars, header._wordBytes);
+    writeArray(out, m._gramTokens, m._gramCount * m._n * sizeof(TokenId));
+    writeArray(out, m._edgeOffsets, (m._gramCount + 1) * sizeof(uint32_t));
+    writeArray(out, m._edges, m._edgeCount * sizeof(FrozenEdge));
+    writeArray(out, m._endDistances, m._gramCount * sizeof(uint32_t));
+    out.close();
+    return !out.fail();
+}
 
+shared_ptr<SentenceBuilder> SentenceBuilder::load(const string& filename) {
+    unique_ptr<MappedFile> file(new MappedFile(filename));
+    if (!file->is_open() || file->size() < sizeof(SnapshotHeader)) {
+        return shared_ptr<SentenceBuilder>(NULL);
+    }
 
+    const char* base = file->data();
+    const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(base);
+    if (memcmp(header->_magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+        header->_version != kSnapshotVersion || header->_rules != kSnapshotRules) {
+        return shared_ptr<SentenceBuilder>(NULL);
+    }
+    if (!plausible(*header, file->size())) {
+        return shared_ptr<SentenceBuilder>(NULL);
+    }
+    SnapshotLayout layout(*header);
+    if (layout._end != file->size()) {
+        return shared_ptr<SentenceBuilder>(NULL);
+    }
 
-#include <iostream>
-#include <dirent.h>
-#include <map>
-#include <cstdlib>
-#include <memory>
+    // The model reads straight out of the mapping; nothing is rebuilt
+    shared_ptr<SentenceBuilder> sb(new SentenceBuilder(header->_n));
+    FrozenModel& m = sb->_frozen;
+    m._n = header->_n;
+    m._wordCount = header->_wordCount;
+    m._gramCount = header->_gramCount;
+    m._edgeCount = header->_edgeCount;
+    m._wordOffsets = reinterpret_cast<const uint64_t*>(base + layout._wordOffsets);
+    m._wordChars = base + layout._wordChars;
+    m._gramTokens = reinterpret_cast<const TokenId*>(base + layout._gramTokens);
+    m._edgeOffsets = reinterpret_cast<const uint32_t*>(base + layout._edgeOffsets);
+    m._edges = reinterpret_cast<const FrozenEdge*>(base + layout._edges);
+    m._endDistances = reinterpret_cast<const uint32_t*>(base + layout._endDistances);
+    if (m._wordOffsets[m._wordCount] != header->_wordBytes || !consistent(m)) {
+        return shared_ptr<SentenceBuilder>(NULL);
+    }
+    sb->_snapshot = move(file);
+    return sb;
+}
 
-using namespace std;
+//======================================================================
+// SentenceBuilderStats
+//
 
-#include "SentenceBuilder.h"
+// Divides, or returns 0 for nothing over nothing.
+static double perEach(double a, double b) {
+    return b == 0 ? 0 : a / b;
+}
 
-void usage();
-vector<string> getNames(string dirName);
+string SentenceBuilderStats::to_str() const {
+    stringstream ss;
+    ss << fixed << setprecision(1);
+    ss << "grams            " << _grams << endl;
+    ss << "edges            " << _edges << " (at most " << _maxOutDegree << " from one gram)" << endl;
+    ss << "memory           " << _bytes << " bytes" << endl;
+    if (!kCollectStats) {
+        ss << "(build with -DSENTENCE_BUILDER_STATS for counters)" << endl;
+        return ss.str();
+    }
+    ss << "tokens read      " << _tokens << endl;
+    ss << "sentences read   " << _sentences << " (" << perEach(_tokens, _sentences)
+       << " tokens each)" << endl;
+    ss << "gram lookups     " << _hits + _misses << " (" << 100 * perEach(_hits, _hits + _misses)
+       << "% found)" << endl;
+    ss << "generated        " << _generated << " sentences (" << perEach(_generatedTokens, _generated)
+       << " tokens, " << perEach(_generateNanos, _generated) << " ns each)" << endl;
+    return ss.str();
+}
 
-int main(int argc, char* argv[]) {
-    if (argc != 3) usage();
+//======================================================================
+// Gram
+//
 
-    uint32_t gramSize = atoi(argv[1]);
-    string dirName = argv[2];
+// TokenSpan _tokens;
+// vector<Edge> _edges;
+// unique_ptr<unordered_map<Gram*, uint32_t> > _edgeIndex;
 
-    // Maps from token (such as "hugo" or "kafka") to corresponding
-    // SentenceBuilder.
-    map<string, shared_ptr<SentenceBuilder> > builders;
-
-    // Get a vector of filenames from the target directory
-    vector<string> names = getNames(dirName);
-
-    // Construct all the necessary SentenceBuilders
-    vector<string>::iterator nameIt;
-    for (nameIt = names.begin(); nameIt != names.end(); ++nameIt) {
-        string name = dirName + "/" + *nameIt;
-        string shortName = *nameIt;
-        shortName.erase(shortName.size() - 4);
-        
-        cout << "Constructing model " << shortName << endl;
-        
-        // Create a SentenceBuilder
-        shared_ptr<SentenceBuilder> sb(new SentenceBuilder(name, gramSize));
+// Out-degree past which addEdge() stops scanning _edges linearly.
+static const uint32_t kEdgeIndexThreshold = 16;
+
+Gram::Gram(TokenSpan tokens) : _tokens(tokens) { }
 
-        // Add an entry in the token -> SentenceBuilder map
-        pair<string, shared_ptr<SentenceBuilder> > el(shortName, sb);
-        builders.insert(el);
+void Gram::addEdge(Gram* target, uint32_t count) {
+    if (_edgeIndex) {
+        unordered_map<Gram*, uint32_t>::iterator it = _edgeIndex->find(target);
+        if (it != _edgeIndex->end()) {
+            _edges[it->second]._count += count;
+        } else {
+            _edgeIndex->insert(pair<Gram*, uint32_t>(target, _edges.size()));
+            _edges.push_back(Edge(target, count));
+        }
+        return;
     }
-    cout << endl;
 
-    // Prompt user for input
-    do {
-        string model;
-        
-        cout << "Enter model name to generate sentence using that model," << endl;
-        cout << "list for a list of models, or exit to exit: ";
-        cin >> model;
+    uint32_t i;
+    for (i = 0; i < _edges.size(); ++i) {
+        if (_edges[i]._target == target) {
+            _edges[i]._count += count;
+            return;
+        }
+    }
+    _edges.push_back(Edge(target, count));
 
-        if (model == "exit" || builders.find(model) == builders.end()) {
-            break;
+    // High out-degree grams (the root, mostly) get a hash index so that
+    // each occurrence costs one lookup instead of a scan.
+    if (_edges.size() > kEdgeIndexThreshold) {
+        _edgeIndex.reset(new unordered_map<Gram*, uint32_t>());
+        for (i = 0; i < _edges.size(); ++i) {
+            _edgeIndex->insert(pair<Gram*, uint32_t>(_edges[i]._target, i));
         }
+    }
+}
 
-        shared_ptr<SentenceBuilder> sb(builders[model]);
-        string sentence = sb->buildSentence();
-        cout << endl << "\t" << sentence << endl << endl;
-        
-    } while(true);
+string Gram::to_str(const TokenDictionary& dict) {
+    return ::vecToString(vector<TokenId>(_tokens.begin(), _tokens.end()), dict);
+}
 
-    return EXIT_SUCCESS;
+//======================================================================
+// GramIndex
+//
+
+// vector<Slot> _slots;
+// size_t _size;
+
+// Slots the index starts with; it doubles whenever it's half full.
+static const size_t kGramIndexInitialSlots = 16;
+
+template <class Keys>
+GramIndex<Keys>::GramIndex() : _slots(kGramIndexInitialSlots), _size(0) { }
+
+template <class Keys>
+typename GramIndex<Keys>::Slot& GramIndex<Keys>::find(const typename Keys::Key& key, size_t hash) {
+    // Make room first, so the empty slot returned can be filled
+    if ((_size + 1) * 2 > _slots.size()) {
+        grow();
+    }
+
+    size_t mask = _slots.size() - 1;
+    size_t i = home(hash);
+    while (true) {
+        Slot& slot = _slots[i];
+        if (slot._gram == NULL || (slot._hash == hash && slot._key == key)) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
 }
 
-vector<string> getNames(string dirName) {
-    vector<string> names;
+template <class Keys>
+void GramIndex<Keys>::insert(Slot& slot, const typename Keys::Key& key, size_t hash, Gram* gram) {
+    slot._key = key;
+    slot._hash = hash;
+    slot._gram = gram;
+    ++_size;
+}
 
-    DIR* dirPtr = opendir(dirName.c_str());
-    if (dirPtr == NULL) usage();
+// The slot a hash would be in if nothing else were. Polynomial hashes
+// are weak in their low bits, so the top bits of a multiplicative
+// scramble pick the slot instead.
+template <class Keys>
+size_t GramIndex<Keys>::home(size_t hash) const {
+    uint32_t bits = __builtin_ctzll(_slots.size());
+    return (hash * 0xff51afd7ed558ccdULL) >> (64 - bits);
+}
 
-    struct dirent* dirp;
-    while ((dirp = readdir(dirPtr)) != NULL) {
-        string name(dirp->d_name);
-        if (name != ".." && name != ".") {
-            names.push_back(string(dirp->d_name));
+template <class Keys>
+void GramIndex<Keys>::grow() {
+    vector<Slot> old(_slots.size() * 2);
+    old.swap(_slots);
+
+    size_t mask = _slots.size() - 1;
+    size_t i;
+    for (i = 0; i < old.size(); ++i) {
+        if (old[i]._gram == NULL) {
+            continue;
+        }
+        size_t j = home(old[i]._hash);
+        while (_slots[j]._gram != NULL) {
+            j = (j + 1) & mask;
         }
+        _slots[j] = old[i];
     }
+}
 
-    closedir(dirPtr);
+//======================================================================
+// GramTable
+//
 
-    return names;
+// Arena _arena;
+// TokenDictionary _dict;
+// GramIndex<Keys> _grams;
+// Gram* _root;
+// uint64_t _tokens;
+// uint64_t _sentences;
+// uint64_t _hits;
+// uint64_t _misses;
+
+template <class Keys>
+BasicGramTable<Keys>::BasicGramTable() : _tokens(0), _sentences(0), _hits(0), _misses(0) {
+    _root = new (_arena.allocate(sizeof(Gram), alignof(Gram))) Gram(TokenSpan(NULL, 0));
 }
 
-void usage() {
-    cerr << "Usage: ./soln_ex12 N directoryname" << endl;
-    exit(EXIT_FAILURE);
+template <class Keys>
+BasicGramTable<Keys>::~BasicGramTable() {
+    // Grams live in _arena, which frees its blocks all at once; all
+    // that's left is to let each gram free its edge list.
+    size_t i;
+    for (i = 0; i < _grams.capacity(); ++i) {
+        if (_grams.at(i) != NULL) {
+            _grams.at(i)->~Gram();
+        }
+    }
+    _root->~Gram();
+}
+
+template <class Keys>
+Gram* BasicGramTable<Keys>::GetDefaultOrAdd(TokenSpan tokens, size_t hash) {
+    typename Keys::Key key = Keys::key(tokens);
+    typename GramIndex<Keys>::Slot& slot = _grams.find(key, hash);
+    if (slot._gram != NULL) {
+        if (kCollectStats) {
+            ++_hits;
+        }
+        return slot._gram;
+    }
+    if (kCollectStats) {
+        ++_misses;
+    }
+
+    // The gram and its copy of the tokens share the table's arena, and
+    // the index's key may view that copy
+    TokenId* ids = static_cast<TokenId*>(_arena.allocate(tokens.size() * sizeof(TokenId),
+                                                         alignof(TokenId)));
+    copy(tokens.begin(), tokens.end(), ids);
+    TokenSpan copied(ids, tokens.size());
+    Gram* gram = new (_arena.allocate(sizeof(Gram), alignof(Gram))) Gram(copied);
+    _grams.insert(slot, Keys::key(copied), hash, gram);
+    return gram;
+}
+
+template <class Keys>
+size_t BasicGramTable<Keys>::memoryUsage() const {
+    size_t bytes = _arena.reserved() + _dict.memoryUsage() + _grams.memoryUsage();
+    size_t i;
+    for (i = 0; i < _grams.capacity(); ++i) {
+        const Gram* gram = _grams.at(i);
+        if (gram == NULL) {
+            continue;
+        }
+        bytes += gram->_edges.capacity() * sizeof(Edge);
+        if (gram->_edgeIndex) {
+            bytes += gram->_edgeIndex->size() * (sizeof(pair<Gram*, uint32_t>) + 3 * sizeof(void*));
+        }
+    }
+    return bytes + _root->_edges.capacity() * sizeof(Edge);
+}
+
+template <class Keys>
+void BasicGramTable<Keys>::merge(BasicGramTable& other) {
+    // Translate the other table's token IDs into ours
+    vector<TokenId> ids(other._dict.size());
+    uint32_t i;
+    for (i = 0; i < ids.size(); ++i) {
+        ids[i] = _dict.intern(other._dict.word(i));
+    }
+
+    // Its lookups count as ours, but finding its grams again here
+    // doesn't count at all
+    uint64_t hits = _hits + other._hits;
+    uint64_t misses = _misses + other._misses;
+    _tokens += other._tokens;
+    _sentences += other._sentences;
+
+    // Find or create our copy of each of its grams, in the order its
+    // index holds them rather than by address, so the same tables always
+    // merge into the same edge order (and the same seeded sentences)
+    vector<pair<Gram*, Gram*> > copies;
+    unordered_map<Gram*, Gram*> ours;
+    copies.push_back(pair<Gram*, Gram*>(other._root, _root));
+    vector<TokenId> tokens;
+    size_t s;
+    for (s = 0; s < other._grams.capacity(); ++s) {
+        Gram* gram = other._grams.at(s);
+        if (gram == NULL) {
+            continue;
+        }
+        tokens.clear();
+        for (i = 0; i < gram->_tokens.size(); ++i) {
+            tokens.push_back(ids[gram->_tokens[i]]);
+        }
+        copies.push_back(pair<Gram*, Gram*>(gram, GetDefaultOrAdd(tokens)));
+    }
+    ours.insert(copies.begin(), copies.end());
+
+    // Then add its edges (the root's included) to our copies
+    for (s = 0; s < copies.size(); ++s) {
+        const vector<Edge>& edges = copies[s].first->_edges;
+        for (i = 0; i < edges.size(); ++i) {
+            copies[s].second->addEdge(ours[edges[i]._target], edges[i]._count);
+        }
+    }
+    _hits = hits;
+    _misses = misses;
+}
+
+template class GramIndex<SpanKeys>;
+template class GramIndex<FixedKeys<2> >;
+template class GramIndex<FixedKeys<3> >;
+template class BasicGramTable<SpanKeys>;
+template class BasicGramTable<FixedKeys<2> >;
+template class BasicGramTable<FixedKeys<3> >;
+
+//======================================================================
+// TokenDictionary
+//
+
+// Arena _arena;
+// unordered_map<string_view, TokenId> _ids;
+// vector<string_view> _words;
+
+TokenId TokenDictionary::intern(string_view word) {
+    unordered_map<string_view, TokenId>::iterator it = _ids.find(word);
+    if (it != _ids.end()) {
+        return it->second;
+    }
+
+    // Both the key and _words view the arena's copy, which never moves
+    char* chars = static_cast<char*>(_arena.allocate(word.size(), 1));
+    copy(word.begin(), word.end(), chars);
+    TokenId id = _words.size();
+    _words.push_back(string_view(chars, word.size()));
+    _ids.insert(pair<string_view, TokenId>(_words.back(), id));
+    return id;
+}
+
+string_view TokenDictionary::word(TokenId id) const {
+    return _words[id];
+}
+
+size_t TokenDictionary::size() const {
+    return _words.size();
+}
+
+size_t TokenDictionary::memoryUsage() const {
+    // Each map entry is a node plus its share of the buckets
+    return _arena.reserved() + _words.capacity() * sizeof(string_view) +
+           _ids.size() * (sizeof(pair<string_view, TokenId>) + 3 * sizeof(void*));
+}
+
+size_t TokenIdsHash::operator()(const TokenSpan& ids) const {
+    uint64_t hash = 0;
+    uint32_t i;
+    for (i = 0; i < ids.size(); ++i) {
+        hash = hash * kBase + ids[i] + 1;
+    }
+    return hash;
+}
+
+//======================================================================
+// TokenWindow
+//
+
+// vector<TokenId> _ring;
+// uint32_t _n;
+// uint32_t _last;
+// uint64_t _hash;
+// uint64_t _oldest;
+
+TokenWindow::TokenWindow(uint32_t n) : _ring(2 * n), _n(n), _last(n - 1), _hash(0), _oldest(1) {
+    uint32_t i;
+    for (i = 1; i < n; ++i) {
+        _oldest *= TokenIdsHash::kBase;
+    }
+}
+
+void TokenWindow::reset(TokenSpan tokens) {
+    _last = _n - 1;
+    copy(tokens.begin(), tokens.end(), _ring.begin());
+    copy(tokens.begin(), tokens.end(), _ring.begin() + _n);
+    _hash = TokenIdsHash()(tokens);
+}
+
+// The oldest token is the one the newest replaces in the ring.
+void TokenWindow::push(TokenId token) {
+    _last = _last + 1 == _n ? 0 : _last + 1;
+    _hash = (_hash - (_ring[_last] + 1ULL) * _oldest) * TokenIdsHash::kBase + token + 1;
+    _ring[_last] = token;
+    _ring[_last + _n] = token;
+}
+
+bool TokenSpan::operator==(const TokenSpan& other) const {
+    return _length == other._length && equal(_ids, _ids + _length, other._ids);
+}
+
+//======================================================================
+// Arena
+//
+
+// vector<unique_ptr<char[]> > _blocks;
+// char* _next;
+// size_t _left;
+// size_t _reserved;
+
+// Size of each block, unless a single allocation needs more.
+static const size_t kArenaBlockBytes = 256 << 10;
+
+void* Arena::allocate(size_t bytes, size_t align) {
+    size_t skip = (align - reinterpret_cast<uintptr_t>(_next) % align) % align;
+    if (_next == NULL || skip + bytes > _left) {
+        size_t size = max(kArenaBlockBytes, bytes + align);
+        _blocks.push_back(unique_ptr<char[]>(new char[size]));
+        _next = _blocks.back().get();
+        _left = size;
+        _reserved += size;
+        skip = (align - reinterpret_cast<uintptr_t>(_next) % align) % align;
+    }
+
+    void* result = _next + skip;
+    _next += skip + bytes;
+    _left -= skip + bytes;
+    return result;
+}
+
+//======================================================================
+// MappedFile
+//
+
+// const char* _data;
+// size_t _size;
+// bool _open;
+
+MappedFile::MappedFile(const string& filename) : _data(NULL), _size(0), _open(false) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        _size = st.st_size;
+        if (_size == 0) {
+            // mmap rejects empty mappings, but an empty file is still open
+            _open = true;
+        } else {
+            void* addr = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                // We read front to back exactly once
+                madvise(addr, _size, MADV_SEQUENTIAL);
+                _data = static_cast<const char*>(addr);
+                _open = true;
+            }
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (_data != NULL) {
+        munmap(const_cast<char*>(_data), _size);
+    }
+}
+
+//======================================================================
+// TokenStream
+//
+
+// const char* _curr;
+// const char* _end;
+// const char* _block;
+// const char* _blockEnd;
+// uint64_t _spaces;
+// uint64_t _marks;
+// string _normalized;
+
+// Same set as isspace() in the "C" locale, which is what operator>>
+// splits on.
+static inline bool isSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Sets bit i of spaces if block[i] is whitespace, and of marks if it's
+// one of Boundary::kTerminators, for the 64 bytes at block.
+typedef void (*BlockScanner)(const char* block, uint64_t& spaces, uint64_t& marks);
+
+static const uint32_t kTerminatorCount = sizeof(Boundary::kTerminators) - 1;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Whitespace is ' ' or '\t' through '\r', and the latter is the bytes
+// that are at most 4 once 9 is subtracted, in unsigned terms.
+static void scanSSE2(const char* block, uint64_t& spaces, uint64_t& marks) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    spaces = 0;
+    marks = 0;
+    uint32_t i, t;
+    for (i = 0; i < 64; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+        __m128i control = _mm_sub_epi8(bytes, tab);
+        __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(bytes, space),
+                                       _mm_cmpeq_epi8(_mm_min_epu8(control, four), control));
+        __m128i isMark = _mm_setzero_si128();
+        for (t = 0; t < kTerminatorCount; ++t) {
+            isMark = _mm_or_si128(isMark, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(Boundary::kTerminators[t])));
+        }
+        spaces |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(isSpace))) << i;
+        marks |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(isMark))) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+static void scanAVX2(const char* block, uint64_t& spaces, uint64_t& marks) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    spaces = 0;
+    marks = 0;
+    uint32_t i, t;
+    for (i = 0; i < 64; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+        __m256i control = _mm256_sub_epi8(bytes, tab);
+        __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, space),
+                                          _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control));
+        __m256i isMark = _mm256_setzero_si256();
+        for (t = 0; t < kTerminatorCount; ++t) {
+            isMark = _mm256_or_si256(isMark,
+                                     _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(Boundary::kTerminators[t])));
+        }
+        spaces |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(isSpace))) << i;
+        marks |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(isMark))) << i;
+    }
+}
+
+static BlockScanner pickScanner() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? scanAVX2 : scanSSE2;
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+// NEON has no movemask, so each lane keeps only its own bit and the
+// lanes of each half are summed into a byte.
+static inline uint16_t movemask(uint8x16_t lanes) {
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t masked = vandq_u8(lanes, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(masked)) | (vaddv_u8(vget_high_u8(masked)) << 8);
+}
+
+static void scanNEON(const char* block, uint64_t& spaces, uint64_t& marks) {
+    spaces = 0;
+    marks = 0;
+    uint32_t i, t;
+    for (i = 0; i < 64; i += 16) {
+        uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(block + i));
+        uint8x16_t isSpace = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8(' ')),
+                                      vcleq_u8(vsubq_u8(bytes, vdupq_n_u8('\t')), vdupq_n_u8(4)));
+        uint8x16_t isMark = vdupq_n_u8(0);
+        for (t = 0; t < kTerminatorCount; ++t) {
+            isMark = vorrq_u8(isMark, vceqq_u8(bytes, vdupq_n_u8(Boundary::kTerminators[t])));
+        }
+        spaces |= static_cast<uint64_t>(movemask(isSpace)) << i;
+        marks |= static_cast<uint64_t>(movemask(isMark)) << i;
+    }
+}
+
+static BlockScanner pickScanner() {
+    return scanNEON;
+}
+
+#else
+
+static void scanScalar(const char* block, uint64_t& spaces, uint64_t& marks) {
+    spaces = 0;
+    marks = 0;
+    uint32_t i, t;
+    for (i = 0; i < 64; ++i) {
+        spaces |= static_cast<uint64_t>(isSpace(block[i])) << i;
+        for (t = 0; t < kTerminatorCount; ++t) {
+            marks |= static_cast<uint64_t>(block[i] == Boundary::kTerminators[t]) << i;
+        }
+    }
+}
+
+static BlockScanner pickScanner() {
+    return scanScalar;
+}
+
+#endif
+
+static const BlockScanner scanBlock = pickScanner();
+
+// Classifies the up to 64 bytes from block on. Past the end of the
+// buffer counts as whitespace, so every token ends inside a block.
+void TokenStream::load(const char* block) {
+    _block = block;
+    if (_end - block >= 64) {
+        _blockEnd = block + 64;
+        scanBlock(block, _spaces, _marks);
+    } else {
+        char padded[64];
+        memset(padded, ' ', sizeof(padded));
+        memcpy(padded, block, _end - block);
+        _blockEnd = _end;
+        scanBlock(padded, _spaces, _marks);
+    }
+}
+
+bool TokenStream::next(string_view& token, bool& ends) {
+    // Skip whitespace, a block at a time where there's nothing else
+    while (true) {
+        if (_curr == _blockEnd) {
+            if (_curr == _end) {
+                return false;
+            }
+            load(_curr);
+        }
+        uint64_t text = ~_spaces >> (_curr - _block);
+        if (text != 0) {
+            _curr += __builtin_ctzll(text);
+            break;
+        }
+        _curr = _blockEnd;
+    }
+
+    // The token runs up to the next whitespace, which may be blocks away
+    const char* start = _curr;
+    bool marked = false;
+    while (true) {
+        uint64_t spaces = _spaces >> (_curr - _block);
+        uint64_t marks = _marks >> (_curr - _block);
+        if (spaces != 0) {
+            uint32_t length = __builtin_ctzll(spaces);
+            marked |= (marks & ((1ULL << length) - 1)) != 0;
+            _curr += length;
+            break;
+        }
+        marked |= marks != 0;
+        load(_blockEnd);
+        _curr = _block;
+    }
+
+    string_view text(start, _curr - start);
+    ends = Boundary::ends(text, marked);
+    token = Normalization::normalize(text, _normalized);
+    return true;
+}
+
+//======================================================================
+// Boundary and normalization rules
+//
+
+constexpr char PeriodBoundary::kTerminators[];
+constexpr char PunctuationBoundary::kTerminators[];
+
+// Lower-cased, without their final '.'.
+static const char* const kAbbreviations[] = {
+    "mr", "mrs", "ms", "dr", "prof", "sr", "jr", "st", "vs", "e.g", "i.e", "cf", "no", "mt"
+};
+
+static inline bool isOneOf(char c, const char* set) {
+    return c != '\0' && strchr(set, c) != NULL;
+}
+
+bool PunctuationBoundary::ends(string_view token, bool marked) {
+    if (!marked) {
+        return false;
+    }
+
+    // Look past closing quotes and brackets
+    size_t end = token.size();
+    while (end > 0 && isOneOf(token[end - 1], "\"')]}")) {
+        --end;
+    }
+    if (end == 0 || !isOneOf(token[end - 1], kTerminators)) {
+        return false;
+    }
+    if (token[end - 1] != '.' || (end >= 2 && token[end - 2] == '.')) {
+        return true;
+    }
+
+    // A period after a single letter or a known abbreviation doesn't
+    // end anything
+    string_view word = token.substr(0, end - 1);
+    while (!word.empty() && isOneOf(word[0], "\"'([{")) {
+        word.remove_prefix(1);
+    }
+    if (word.size() == 1 && isalpha(static_cast<unsigned char>(word[0]))) {
+        return false;
+    }
+    uint32_t i;
+    for (i = 0; i < sizeof(kAbbreviations) / sizeof(kAbbreviations[0]); ++i) {
+        if (word.size() == strlen(kAbbreviations[i]) &&
+            equal(word.begin(), word.end(), kAbbreviations[i], [](char a, char b) {
+                return tolower(static_cast<unsigned char>(a)) == b;
+            })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+string_view FoldCase::normalize(string_view token, string& scratch) {
+    // Most tokens have nothing to fold and are left where they are
+    string_view::const_iterator upper = find_if(token.begin(), token.end(), [](char c) {
+        return c >= 'A' && c <= 'Z';
+    });
+    if (upper == token.end()) {
+        return token;
+    }
+
+    scratch.assign(token.data(), token.size());
+    string::iterator it;
+    for (it = scratch.begin() + (upper - token.begin()); it != scratch.end(); ++it) {
+        if (*it >= 'A' && *it <= 'Z') {
+            *it += 'a' - 'A';
+        }
+    }
+    return scratch;
+}
+
+//======================================================================
+// Helpers
+//
+
+// Files smaller than this are never split.
+static const size_t kMinChunkBytes = 4 << 20;
+
+// Splits data into about one chunk per core, each ending right after a
+// token containing '.', which is where startSentence would begin anyway.
+vector<string_view> splitSentences(const char* data, size_t size) {
+    size_t chunks = max<size_t>(1, thread::hardware_concurrency());
+    chunks = max<size_t>(1, min(chunks, size / kMinChunkBytes));
+
+    vector<string_view> result;
+    size_t begin = 0;
+    size_t k;
+    for (k = 1; k < chunks && begin < size; ++k) {
+        // Back up to the start of whatever token the even split lands in
+        size_t end = max(begin, size * k / chunks);
+        while (end > begin && !isSpace(data[end - 1])) {
+            --end;
+        }
+
+        // Then end the chunk after the next sentence
+        TokenStream stream(data + end, size - end);
+        string_view text;
+        bool ends;
+        end = size;
+        while (stream.next(text, ends)) {
+            if (ends) {
+                end = stream.position() - data;
+                break;
+            }
+        }
+
+        result.push_back(string_view(data + begin, end - begin));
+        begin = end;
+    }
+    if (begin < size || result.empty()) {
+        result.push_back(string_view(data + begin, size - begin));
+    }
+    return result;
+}
+
+// Threads that may still be started beyond the ones already working:
+// one per core, less the one that started the program.
+static atomic<uint32_t>& spareThreads() {
+    static atomic<uint32_t> spare(max(1u, thread::hardware_concurrency()) - 1);
+    return spare;
+}
+
+uint32_t claimThreads(uint32_t wanted) {
+    atomic<uint32_t>& spare = spareThreads();
+    uint32_t have = spare.load();
+    uint32_t take = min(have, wanted);
+    while (take != 0 && !spare.compare_exchange_weak(have, have - take)) {
+        take = min(have, wanted);
+    }
+    return take;
+}
+
+void releaseThreads(uint32_t count) {
+    spareThreads() += count;
+}
+
+void parallelFor(size_t count, const function<void(size_t)>& body) {
+    // The caller works too, so it only needs helpers for the rest
+    size_t wanted = min<size_t>(max(1u, thread::hardware_concurrency()), count);
+    size_t threads = 1 + claimThreads(wanted == 0 ? 0 : wanted - 1);
+
+    // Each worker claims the next unclaimed index until none are left,
+    // so one slow item doesn't hold up a whole fixed slice.
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < count) {
+            body(i);
+        }
+    };
+
+    vector<thread> pool;
+    size_t t;
+    for (t = 1; t < threads; ++t) {
+        pool.push_back(thread(worker));
+    }
+    worker();
+    for (t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+    releaseThreads(pool.size());
+}
+
+string vecToString(const vector<TokenId>& tokens, const TokenDictionary& dict) {
+    stringstream ss;
+    uint32_t i;
+    for (i = 0; i < tokens.size(); ++i) {
+        ss << dict.word(tokens[i]) << " ";
+    }
+    return ss.str();
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+
+#ifndef SENTENCE_BUILDER_HEADER
+#define SENTENCE_BUILDER_HEADER
+
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <string_view>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+
+using namespace std;
+
+// Every distinct word in a text is stored once and referred to by its ID.
+typedef uint32_t TokenId;
+
+// Hands out memory from large blocks, which are freed all at once when
+// the arena is. Nothing allocated from an arena is ever destroyed by it.
+class Arena {
+  private:
+    vector<unique_ptr<char[]> > _blocks;
+    char* _next;
+    size_t _left;
+    size_t _reserved;
+
+  public:
+    Arena() : _next(NULL), _left(0), _reserved(0) { }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returns bytes of uninitialized memory aligned to align.
+    void* allocate(size_t bytes, size_t align);
+
+    // Returns the total size of the blocks allocated so far.
+    size_t reserved() const { return _reserved; }
+};
+
+// Maps words to dense IDs (0, 1, 2, ...) in the order they're first seen.
+class TokenDictionary {
+  private:
+    Arena _arena;
+    unordered_map<string_view, TokenId> _ids;
+    vector<string_view> _words;
+
+  public:
+    // Returns the ID of word, assigning it the next ID if it's new. The
+    // word is only copied the first time it's seen.
+    TokenId intern(string_view word);
+
+    // Returns the word with the given ID. The ID must have come from
+    // intern().
+    string_view word(TokenId id) const;
+
+    // Returns the number of distinct words.
+    size_t size() const;
+
+    // Roughly how many bytes the dictionary occupies.
+    size_t memoryUsage() const;
+};
+
+// A run of token IDs stored elsewhere.
+struct TokenSpan {
+    const TokenId* _ids;
+    uint32_t _length;
+
+    TokenSpan() : _ids(NULL), _length(0) { }
+    TokenSpan(const TokenId* ids, uint32_t length) : _ids(ids), _length(length) { }
+
+    const TokenId* begin() const { return _ids; }
+    const TokenId* end() const { return _ids + _length; }
+    uint32_t size() const { return _length; }
+    TokenId operator[](uint32_t i) const { return _ids[i]; }
+    TokenId back() const { return _ids[_length - 1]; }
+    bool operator==(const TokenSpan& other) const;
+};
+
+class Gram;
+
+// A transition to a successor N-gram, weighted by the number of times
+// it occurs in the text.
+struct Edge {
+    Gram* _target;
+    uint32_t _count;
+
+    Edge(Gram* target, uint32_t count) : _target(target), _count(count) { }
+};
+
+// Whether hot paths keep the counters SentenceBuilder::stats() reports.
+// Build with -DSENTENCE_BUILDER_STATS to turn them on; otherwise they
+// compile away.
+#ifdef SENTENCE_BUILDER_STATS
+static const bool kCollectStats = true;
+#else
+static const bool kCollectStats = false;
+#endif
+
+// Represents a particular N-gram. Grams and their tokens belong to the
+// GramTable that created them.
+class Gram {
+public:
+    TokenSpan _tokens;
+    vector<Edge> _edges;
+    unique_ptr<unordered_map<Gram*, uint32_t> > _edgeIndex;
+    
+    Gram(TokenSpan tokens);
+    string to_str(const TokenDictionary& dict);
+
+    // Records count occurrences of the transition to target.
+    void addEdge(Gram* target, uint32_t count = 1);
+};
+
+// A read-only memory mapping of an entire file.
+class MappedFile {
+  private:
+    const char* _data;
+    size_t _size;
+    bool _open;
+
+  public:
+    MappedFile(const string& filename);
+    ~MappedFile();
+
+    bool is_open() const { return _open; }
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+};
+
+// Sentence boundary rules. kTerminators are the characters the
+// tokenizer marks while it scans, and ends() decides whether a token
+// that contains one of them ends its sentence.
+
+// Any token with a '.' in it ends a sentence.
+struct PeriodBoundary {
+    static constexpr char kTerminators[] = ".";
+    static const uint32_t kId = 0;
+
+    static bool ends(string_view, bool marked) { return marked; }
+};
+
+// A token ends a sentence if it ends in '.', '?' or '!', perhaps
+// followed by closing quotes or brackets, unless it's an abbreviation
+// such as "Dr." or an initial.
+struct PunctuationBoundary {
+    static constexpr char kTerminators[] = ".?!";
+    static const uint32_t kId = 1;
+
+    static bool ends(string_view token, bool marked);
+};
+
+// Normalization rules, which map each token to the word it's counted
+// as. normalize() may use scratch to hold the result.
+
+// Words are exactly as they appear in the text.
+struct KeepCase {
+    static const uint32_t kId = 0;
+
+    static string_view normalize(string_view token, string&) { return token; }
+};
+
+// ASCII letters are folded to lower case, so "The" and "the" are the
+// same word.
+struct FoldCase {
+    static const uint32_t kId = 1;
+
+    static string_view normalize(string_view token, string& scratch);
+};
+
+// The rules the tokenizer is built with. Pick others with, say,
+// -DSENTENCE_BOUNDARY=PunctuationBoundary -DSENTENCE_NORMALIZATION=FoldCase
+#ifndef SENTENCE_BOUNDARY
+#define SENTENCE_BOUNDARY PeriodBoundary
+#endif
+#ifndef SENTENCE_NORMALIZATION
+#define SENTENCE_NORMALIZATION KeepCase
+#endif
+typedef SENTENCE_BOUNDARY Boundary;
+typedef SENTENCE_NORMALIZATION Normalization;
+
+// Splits a buffer into whitespace-separated tokens, the same way
+// operator>> would, without copying them. The buffer is classified 64
+// bytes at a time with vector instructions where the CPU has them, and
+// tokens are read off the resulting bitmasks. Sentence boundaries and
+// normalization follow Boundary and Normalization as each token is
+// read, so neither costs another pass over the text.
+class TokenStream {
+  private:
+    const char* _curr;
+    const char* _end;
+
+    // The bytes from _block to _blockEnd, one bit each: which are
+    // whitespace, and which are one of Boundary::kTerminators
+    const char* _block;
+    const char* _blockEnd;
+    uint64_t _spaces;
+    uint64_t _marks;
+
+    string _normalized;
+
+    void load(const char* block);
+
+  public:
+    TokenStream(const char* data, size_t size)
+        : _curr(data), _end(data + size), _block(data), _blockEnd(data), _spaces(0), _marks(0) { }
+
+    // Points token at the next token in the buffer, normalized, and sets
+    // ends if the token ends a sentence. The token may only be valid
+    // until the next call. Returns false (and leaves both alone) once
+    // the buffer is exhausted.
+    bool next(string_view& token, bool& ends);
+
+    // Returns where the last token read ended in the buffer.
+    const char* position() const { return _curr; }
+};
+
+// Pads the token IDs of grams shorter than N in fixed-width arrays.
+static const TokenId kNoToken = 0xffffffff;
+
+// An edge of a FrozenModel.
+struct FrozenEdge {
+    uint32_t _cumulative;   // Running total of the counts of this gram's edges, up to this one
+    uint32_t _target;       // Gram number of the successor
+    TokenId _token;         // The successor's last token, so walks needn't visit it
+};
+
+// A finished model laid out in flat arrays, which is both how
+// generation walks it and how snapshots store it. Grams are numbered
+// from 0, which is the root, and the edges out of gram g are
+// _edges[_edgeOffsets[g]] up to _edges[_edgeOffsets[g + 1]].
+struct FrozenModel {
+    uint32_t _n;
+    uint64_t _wordCount;
+    uint64_t _gramCount;
+    uint64_t _edgeCount;
+
+    const uint64_t* _wordOffsets;    // _wordCount + 1 offsets into _wordChars
+    const char* _wordChars;
+    const TokenId* _gramTokens;      // _n per gram, padded with kNoToken
+    const uint32_t* _edgeOffsets;    // _gramCount + 1
+    const FrozenEdge* _edges;        // _edgeCount
+    const uint32_t* _endDistances;   // _gramCount: fewest edges to a gram with none
+
+    // Returns the word with the given ID.
+    string_view word(TokenId id) const {
+        return string_view(_wordChars + _wordOffsets[id], _wordOffsets[id + 1] - _wordOffsets[id]);
+    }
+};
+
+// The arrays of a FrozenModel that was built in memory.
+struct FrozenStorage {
+    vector<uint64_t> _wordOffsets;
+    string _wordChars;
+    vector<TokenId> _gramTokens;
+    vector<uint32_t> _edgeOffsets;
+    vector<FrozenEdge> _edges;
+    vector<uint32_t> _endDistances;
+};
+
+// The end distance of a gram no walk from can end at.
+static const uint32_t kNeverEnds = 0xffffffff;
+
+// Bounds on a random walk, which otherwise only stops at a gram with no
+// successors. Once it has _softWords words, or _deadline has passed, a
+// walk only takes edges that bring it closer to such a gram (picked in
+// proportion to their counts as usual), so it finishes as soon as the
+// model allows. At _maxWords it stops where it is, mid-sentence if need
+// be. The default bounds nothing.
+struct WalkLimits {
+    uint32_t _softWords;
+    uint32_t _maxWords;
+    chrono::steady_clock::time_point _deadline;
+
+    WalkLimits() : _softWords(UINT32_MAX), _maxWords(UINT32_MAX),
+                   _deadline(chrono::steady_clock::time_point::max()) { }
+};
+
+// Hashes an N-gram by its token IDs, as the polynomial
+// (t0 + 1) B^(k-1) + (t1 + 1) B^(k-2) + ... + (tk-1 + 1) mod 2^64, which
+// TokenWindow can keep up to date as it slides instead of starting over.
+struct TokenIdsHash {
+    static const uint64_t kBase = 0x9e3779b97f4a7c15ULL;
+
+    size_t operator()(const TokenSpan& ids) const;
+};
+
+// The last n tokens of a text, as a view and its TokenIdsHash, updated
+// in constant time per token. The tokens are kept twice over in a ring
+// of 2n, so the window is always contiguous.
+class TokenWindow {
+  private:
+    vector<TokenId> _ring;
+    uint32_t _n;
+    uint32_t _last;         // Where the newest token went, mod n
+    uint64_t _hash;
+    uint64_t _oldest;       // kBase^(n-1), the weight of the oldest token
+
+  public:
+    TokenWindow(uint32_t n);
+
+    // Makes the window exactly tokens, which must be n long.
+    void reset(TokenSpan tokens);
+
+    // Slides the window along by one token.
+    void push(TokenId token);
+
+    TokenSpan view() const { return TokenSpan(_ring.data() + _last + 1, _n); }
+    size_t hash() const { return _hash; }
+};
+
+// How a GramTable keys its grams. Key is what the index stores, and
+// key() makes one from a gram's tokens, which may be a temporary copy.
+// Either way grams are hashed with TokenIdsHash.
+
+// Any n: a gram is keyed by a view of its tokens in the table's arena.
+struct SpanKeys {
+    typedef TokenSpan Key;
+
+    static Key key(TokenSpan tokens) { return tokens; }
+};
+
+// At most N tokens, padded with kNoToken: the key is the tokens
+// themselves, so comparing them unrolls into straight-line code.
+template <uint32_t N>
+struct FixedKeys {
+    struct Key {
+        array<TokenId, N> _ids;
+
+        bool operator==(const Key& other) const { return _ids == other._ids; }
+    };
+
+    static Key key(TokenSpan tokens) {
+        Key key;
+        key._ids.fill(kNoToken);
+        copy(tokens.begin(), tokens.end(), key._ids.begin());
+        return key;
+    }
+};
+
+// Finds grams by their keys: an open-addressing table probed linearly.
+// Each slot keeps its key's full hash, so most mismatches are turned
+// away without comparing keys, and growing never hashes a key again.
+// Looking a key up and adding it if it's missing take one probe.
+template <class Keys>
+class GramIndex {
+  public:
+    struct Slot {
+        typename Keys::Key _key;
+        size_t _hash;
+        Gram* _gram;        // NULL while the slot is empty
+    };
+
+  private:
+    vector<Slot> _slots;
+    size_t _size;
+
+    size_t home(size_t hash) const;
+    void grow();
+
+  public:
+    GramIndex();
+
+    // Returns the slot holding key, whose hash is hash, or else the
+    // empty slot it belongs in. The slot is valid until the next call.
+    Slot& find(const typename Keys::Key& key, size_t hash);
+
+    // Stores gram under key in the empty slot find() returned for it.
+    void insert(Slot& slot, const typename Keys::Key& key, size_t hash, Gram* gram);
+
+    // Slots are numbered from 0 to capacity() - 1; at() returns the gram
+    // in slot i, or NULL.
+    size_t size() const { return _size; }
+    size_t capacity() const { return _slots.size(); }
+    Gram* at(size_t i) const { return _slots[i]._gram; }
+
+    size_t memoryUsage() const { return _slots.capacity() * sizeof(Slot); }
+};
+
+// The grams found in some text, along with the words they're made of.
+// Several tables built over different parts of a text can be folded
+// together with merge(). Keys says how grams are found again.
+template <class Keys>
+class BasicGramTable {
+  public:
+    Arena _arena;
+    TokenDictionary _dict;
+    GramIndex<Keys> _grams;
+    Gram* _root;
+
+    // What ingesting text into the table has done since the counts were
+    // last taken, when kCollectStats
+    uint64_t _tokens;
+    uint64_t _sentences;
+    uint64_t _hits;
+    uint64_t _misses;
+
+    BasicGramTable();
+    ~BasicGramTable();
+    BasicGramTable(const BasicGramTable&) = delete;
+    BasicGramTable& operator=(const BasicGramTable&) = delete;
+
+    // Returns the gram made of tokens, adding it if it's new. tokens
+    // only needs to last for the call; it's copied if the gram is new.
+    // hash must be TokenIdsHash()(tokens), if the caller already knows
+    // it.
+    Gram* GetDefaultOrAdd(TokenSpan tokens, size_t hash);
+    Gram* GetDefaultOrAdd(const vector<TokenId>& tokens) {
+        TokenSpan span(tokens.data(), tokens.size());
+        return GetDefaultOrAdd(span, TokenIdsHash()(span));
+    }
+
+    // Adds other's grams to this table and its edge counts to ours.
+    void merge(BasicGramTable& other);
+
+    // Roughly how many bytes the table occupies.
+    size_t memoryUsage() const;
+};
+
+typedef BasicGramTable<SpanKeys> GramTable;
+
+// The xoshiro256** generator: fast, small, and good enough that sampling
+// from it shows no bias. Each thread should use its own.
+class Xoshiro256 {
+  private:
+    uint64_t _s[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+  public:
+    // Expands seed into the full state with splitmix64, as the authors of
+    // xoshiro recommend.
+    explicit Xoshiro256(uint64_t seed) {
+        int i;
+        for (i = 0; i < 4; ++i) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            _s[i] = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(_s[1] * 5, 7) * 9;
+        uint64_t t = _s[1] << 17;
+        _s[2] ^= _s[0];
+        _s[3] ^= _s[1];
+        _s[1] ^= _s[2];
+        _s[0] ^= _s[3];
+        _s[2] ^= t;
+        _s[3] = rotl(_s[3], 45);
+        return result;
+    }
+
+    // Returns a number uniformly distributed in [0, bound), for bound > 0.
+    // Uses Lemire's multiply-and-reject method, which unlike % has no
+    // modulo bias and almost never divides.
+    uint32_t below(uint32_t bound) {
+        uint64_t m = (next() >> 32) * bound;
+        uint32_t low = static_cast<uint32_t>(m);
+        if (low < bound) {
+            uint32_t threshold = -bound % bound;
+            while (low < threshold) {
+                m = (next() >> 32) * bound;
+                low = static_cast<uint32_t>(m);
+            }
+        }
+        return m >> 32;
+    }
+};
+
+// What a model is made of and what has been asked of it, from
+// SentenceBuilder::stats(). The counters are only kept when
+// kCollectStats is set; the model's shape is always there.
+struct SentenceBuilderStats {
+    // Building, including addText()
+    uint64_t _tokens;               // Tokens read from the text
+    uint64_t _sentences;            // Sentences read
+    uint64_t _hits;                 // Gram lookups that found the gram
+    uint64_t _misses;               // Gram lookups that added it
+
+    // The model
+    uint64_t _grams;
+    uint64_t _edges;
+    uint64_t _maxOutDegree;
+    size_t _bytes;
+
+    // Generating
+    uint64_t _generated;            // Sentences
+    uint64_t _generatedTokens;
+    uint64_t _generateNanos;        // Total time spent in buildSentence(s)
+
+    // Describes the statistics, one per line.
+    string to_str() const;
+};
+
+// What every kind of model can do, for code such as ModelCache and
+// SentenceServer that doesn't mind which kind it has. Any number of
+// threads may call these on one model at once.
+class SentenceModel {
+  public:
+    virtual ~SentenceModel() { }
+
+    // Returns the length of the contexts the model generates from.
+    virtual uint32_t n() const = 0;
+
+    // Appends count random sentences to out, each followed by a newline
+    // and each bounded by limits on its own.
+    virtual void buildSentences(size_t count, Xoshiro256& random, string& out,
+                                const WalkLimits& limits = WalkLimits()) const = 0;
+
+    // Generates a random sentence, handing each word to sink as it's
+    // picked, and returns the number of words. The views stay valid as
+    // long as the model does.
+    virtual uint32_t writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                                   const WalkLimits& limits = WalkLimits()) const = 0;
+
+    // Roughly how many bytes the model occupies.
+    virtual size_t memoryUsage() const = 0;
+
+    // Describes the model's statistics, one per line.
+    virtual string describe() const = 0;
+};
+
+// Represents a class that parses a file, extracts N-grams (for
+// variable N) from it, and can generate random sentences based on these
+// N-grams.
+//
+// Generating a sentence only reads a SentenceBuilder, so any number of
+// threads may call its const methods on one instance at once. Only
+// addText() and addFile() change a model, and they mustn't run
+// alongside any other call on it. The first const call after them may
+// take as long as freezing the whole model does (see addText()).
+class SentenceBuilder : public SentenceModel {
+  private:
+    uint32_t _n;
+
+    // The model's arrays live in _storage, unless it was loaded from
+    // _snapshot
+    FrozenModel _frozen;
+    FrozenStorage _storage;
+    unique_ptr<MappedFile> _snapshot;
+
+    // The gram index, kept from the first addText() on so later ones
+    // can extend it. It holds the whole model over again, in a form
+    // several times larger than the frozen one. _stale says it has
+    // changed since it was last frozen, and _freezing lets just one
+    // reader freeze it.
+    unique_ptr<GramTable> _table;
+    mutable atomic<bool> _stale;
+    mutable mutex _freezing;
+
+    // Counters for stats(). Generating only ever adds to the last
+    // three, with relaxed atomics so concurrent calls don't serialize on
+    // them.
+    SentenceBuilderStats _counts;
+    mutable atomic<uint64_t> _generated;
+    mutable atomic<uint64_t> _generatedTokens;
+    mutable atomic<uint64_t> _generateNanos;
+
+ protected:
+    SentenceBuilder(uint32_t n);
+    template <class Table> void freeze(const Table& table);
+    template <class Table> void ingestText(Table& table, const char* data, size_t size);
+    template <class Table> void takeCounts(Table& table);
+
+  private:
+    void thaw();
+    const FrozenModel& model() const;
+    template <class Random, class Sink>
+    uint32_t walk(Random& random, Sink& sink, const WalkLimits& limits) const;
+    void countGenerated(uint64_t sentences, uint64_t words,
+                        chrono::steady_clock::time_point start) const;
+    template <class Table> void ingest(Table& table, TokenStream& stream);
+    template <class Table> Gram* startSentence(Table& table, TokenStream& stream);
+    
+  public:
+    // Constructs a SentenceBuilder for a given file. The
+    // SentenceBuilder will track n-grams of length n.
+    SentenceBuilder(string& filename, uint32_t n);
+    ~SentenceBuilder();
+
+    // Generates a returns a random sentence. The random sentence
+    // contains only n-grams from the given file. 
+    string buildSentence(const WalkLimits& limits = WalkLimits()) const;
+
+    // Appends count random sentences to out, each followed by a newline,
+    // drawing from random instead of rand(). Reusing out across calls
+    // avoids allocating once it has grown large enough. Each sentence is
+    // bounded by limits on its own.
+    void buildSentences(size_t count, Xoshiro256& random, string& out,
+                        const WalkLimits& limits = WalkLimits()) const override;
+
+    // Generates a random sentence like buildSentence(), but instead of
+    // building a string hands each word to sink(string_view) as it's
+    // picked. The views point into the model's own dictionary and stay
+    // valid as long as the model does, so a sink can write them straight
+    // to a file or socket buffer without copying. Returns the number of
+    // words.
+    template <class Sink>
+    uint32_t streamSentence(Xoshiro256& random, Sink&& sink,
+                            const WalkLimits& limits = WalkLimits()) const;
+
+    // Same as streamSentence(), for callers that only have a
+    // SentenceModel.
+    uint32_t writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                           const WalkLimits& limits = WalkLimits()) const override;
+
+    // Extends the model with the n-grams of text, as though text had
+    // been at the end of the file it was built from, starting a new
+    // sentence. Works on loaded snapshots too. The first call rebuilds
+    // the gram index from the model and keeps it, which costs as much
+    // memory again as the model takes, and more. Each call only
+    // tokenizes and counts text, but the model then has to be laid out
+    // flat again, all of it, which is left for the next call that reads
+    // it; so adding many texts before generating pays for that once.
+    void addText(string_view text);
+
+    // Same as addText(), with the contents of a file. Returns false if
+    // the file can't be read.
+    bool addFile(const string& filename);
+
+    // Returns the length of the n-grams this SentenceBuilder tracks.
+    uint32_t n() const override;
+
+    // Returns the number of distinct n-grams in the model, and the
+    // number of distinct transitions between them.
+    uint64_t gramCount() const;
+    uint64_t edgeCount() const;
+
+    // Returns the model's flat arrays, for building other forms of it.
+    const FrozenModel& frozen() const;
+
+    // Roughly how many bytes this model occupies, counting a mapped
+    // snapshot in full.
+    size_t memoryUsage() const override;
+
+    // Returns the shape of the model and, when they're collected, how
+    // it was built and used. Safe to call while other threads generate.
+    SentenceBuilderStats stats() const;
+
+    // stats(), spelled out.
+    string describe() const override;
+
+    // Writes this model to a snapshot file. Returns false if the file
+    // couldn't be written.
+    bool save(const string& filename) const;
+
+    // Maps a snapshot written by save(). The model is used in place
+    // from the mapping, once it's been checked through. Returns NULL if
+    // the file isn't a snapshot, or is truncated or corrupt.
+    static shared_ptr<SentenceBuilder> load(const string& filename);
+
+    // Constructs a SentenceBuilder for a given file, as a SentenceBuilderN
+    // if n is one of the orders that's specialized for.
+    static shared_ptr<SentenceBuilder> create(string& filename, uint32_t n);
+
+    // Combines models into one, as though it had been built from each
+    // of their texts weights[i] > 0 times over (once each if weights is
+    // empty): words are joined by spelling and edge counts are summed.
+    // Takes time in proportion to the models, not their texts, thawing
+    // them all and folding them together on one thread per core. Returns
+    // NULL if there are no models, their n differ, or the weighted
+    // counts could overflow.
+    static shared_ptr<SentenceBuilder> merge(const vector<const SentenceBuilder*>& models,
+                                             const vector<uint32_t>& weights);
+};
+
+// A sink for SentenceBuilder::walk() that appends each word and a space
+// to a string, which is how buildSentence(s) have always spelled out
+// sentences.
+struct StringSink {
+    string& _out;
+
+    explicit StringSink(string& out) : _out(out) { }
+
+    void operator()(string_view word) {
+        _out += word;
+        _out += ' ';
+    }
+};
+
+// Words a walk takes between looks at the clock.
+static const uint32_t kDeadlineWords = 16;
+
+// Returns the number of words it passed to sink.
+template <class Random, class Sink>
+uint32_t SentenceBuilder::walk(Random& random, Sink& sink, const WalkLimits& limits) const {
+    const FrozenModel& m = model();
+    uint32_t curr = 0;
+    uint32_t words = 0;
+    bool ending = limits._softWords == 0;
+    while (m._edgeOffsets[curr] != m._edgeOffsets[curr + 1] && words < limits._maxWords) {
+        const FrozenEdge* begin = m._edges + m._edgeOffsets[curr];
+        const FrozenEdge* end = m._edges + m._edgeOffsets[curr + 1];
+        const FrozenEdge* edge;
+        uint32_t distance = ending ? m._endDistances[curr] : kNeverEnds;
+        if (distance == kNeverEnds) {
+            // The first edge whose running total exceeds r owns occurrence
+            // r, so each successor is picked in proportion to its count
+            uint32_t r = random.below(end[-1]._cumulative);
+            edge = upper_bound(begin, end, r, [](uint32_t r, const FrozenEdge& e) {
+                return r < e._cumulative;
+            });
+        } else {
+            // The same, among only the edges one step closer to an end,
+            // of which there's always at least one
+            uint32_t total = 0, prev = 0;
+            for (edge = begin; edge != end; prev = edge->_cumulative, ++edge) {
+                if (m._endDistances[edge->_target] < distance) {
+                    total += edge->_cumulative - prev;
+                }
+            }
+            uint32_t r = random.below(total);
+            for (edge = begin, prev = 0; ; prev = edge->_cumulative, ++edge) {
+                if (m._endDistances[edge->_target] < distance) {
+                    uint32_t count = edge->_cumulative - prev;
+                    if (r < count) {
+                        break;
+                    }
+                    r -= count;
+                }
+            }
+        }
+
+        sink(m.word(edge->_token));
+        curr = edge->_target;
+        ++words;
+
+        if (!ending) {
+            ending = words >= limits._softWords ||
+                     (words % kDeadlineWords == 0 &&
+                      limits._deadline != chrono::steady_clock::time_point::max() &&
+                      chrono::steady_clock::now() >= limits._deadline);
+        }
+    }
+    return words;
+}
+
+template <class Sink>
+uint32_t SentenceBuilder::streamSentence(Xoshiro256& random, Sink&& sink,
+                                         const WalkLimits& limits) const {
+    chrono::steady_clock::time_point start;
+    if (kCollectStats) {
+        start = chrono::steady_clock::now();
+    }
+
+    uint32_t words = walk(random, sink, limits);
+
+    if (kCollectStats) {
+        countGenerated(1, words, start);
+    }
+    return words;
+}
+
+// A SentenceBuilder whose n is fixed at compile time, for the orders
+// used most. It builds exactly the model SentenceBuilder(filename, N)
+// does, but indexes grams by arrays of N token IDs while it does, so
+// finding each gram costs an unrolled compare. Instantiated for N = 2
+// and N = 3.
+template <uint32_t N>
+class SentenceBuilderN : public SentenceBuilder {
+  public:
+    SentenceBuilderN(string& filename);
+};
+
+// Calls body(i) for every 0 <= i < count, on the calling thread and as
+// many others as claimThreads() allows, up to one per core. Returns once
+// every call has returned.
+void parallelFor(size_t count, const function<void(size_t)>& body);
+
+// Claims up to wanted more threads from a budget shared by the whole
+// process, of one per core besides the main thread, and returns how
+// many it got, perhaps none. Threads started for parallel work take
+// their share here and give it back with releaseThreads() once they've
+// finished, so parallel work started within parallel work (a big text
+// split up by one of several threads building models, say) doesn't
+// multiply the threads.
+uint32_t claimThreads(uint32_t wanted);
+void releaseThreads(uint32_t count);
+
+#endif // SENTENCE_BUILDER_HEADER
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#ifndef BACKOFF_MODEL_HEADER
+#define BACKOFF_MODEL_HEADER
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+
+// Generates sentences from contexts of any length up to the one it was
+// built with, from a single copy of the text's statistics.
+//
+// At order k each word is picked, in proportion to how often it
+// followed them, given the k tokens before it in its sentence, counting
+// a marker for the start of the sentence as one. Within a sentence
+// that's the same choice SentenceBuilder(k) makes, but the sentences
+// aren't the same: a walk always goes on to a word that ends a
+// sentence, so every sentence of the text can come out whole. A
+// SentenceBuilder(k) leaves the last word off a sentence of k tokens or
+// fewer, and never says one of one token. From "Hi there. The dog ran.
+// The cat ran home. Hi." at k = 3, SentenceBuilder says "Hi" and "The
+// dog" where this says "Hi there." and "The dog ran.", and this also
+// says "Hi.".
+//
+// The model is a trie of every run of up to maxOrder + 1 tokens within
+// a sentence, where each node counts how often its run occurs and
+// links to the node for the same run minus its first token. A context
+// that was never continued in the text (the one at the very end, if
+// the text stops mid-sentence) backs off to shorter ones.
+//
+// Each node also keeps, in a byte, the fewest tokens that followed its
+// run before the end of a sentence. That never grows as a walk goes
+// along a child and drops the child's first token, and some child of
+// each node has one fewer, so a walk that WalkLimits has told to end
+// takes only children with fewer, and ends within that many words. As
+// with CompactModel, a node 255 or more tokens from an end is left as
+// usual.
+//
+// Any number of threads may generate from one BackoffModel at once. As
+// a SentenceModel it generates at its largest order.
+class BackoffModel : public SentenceModel {
+  private:
+    uint32_t _maxOrder;
+    TokenDictionary _dict;
+    vector<uint8_t> _ends;              // Whether each word ends a sentence
+
+    // Node 0 is the empty run, and _start is the sentence marker. The
+    // children of node v are _children[_childOffsets[v]] up to
+    // _children[_childOffsets[v + 1]], with running totals of their
+    // counts; _links[v] is v without its first token, and _remaining[v]
+    // is how near v is to an end.
+    uint32_t _start;
+    vector<uint32_t> _childOffsets;
+    vector<FrozenEdge> _children;
+    vector<uint32_t> _links;
+    vector<uint8_t> _remaining;
+
+    template <class Random, class Sink>
+    uint32_t walk(uint32_t order, Random& random, Sink& sink, const WalkLimits& limits) const;
+
+  public:
+    // Builds the model for file in one pass over it. Orders from 1 up to
+    // maxOrder can be generated.
+    BackoffModel(const string& filename, uint32_t maxOrder);
+
+    // Generates a random sentence using contexts of up to order tokens,
+    // for 1 <= order <= maxOrder(), bounded by limits.
+    string buildSentence(uint32_t order, const WalkLimits& limits = WalkLimits()) const;
+
+    // Appends count random sentences of the given order to out, each
+    // followed by a newline and each bounded by limits on its own.
+    void buildSentences(size_t count, uint32_t order, Xoshiro256& random, string& out,
+                        const WalkLimits& limits = WalkLimits()) const;
+
+    // The same, at maxOrder().
+    void buildSentences(size_t count, Xoshiro256& random, string& out,
+                        const WalkLimits& limits = WalkLimits()) const override;
+    uint32_t writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                           const WalkLimits& limits = WalkLimits()) const override;
+
+    // Returns the longest context this model can generate from, which
+    // n() does too.
+    uint32_t maxOrder() const;
+    uint32_t n() const override;
+
+    // Roughly how many bytes this model occupies.
+    size_t memoryUsage() const override;
+
+    // Describes the model's size, one statistic per line.
+    string describe() const override;
+};
+
+#endif // BACKOFF_MODEL_HEADER
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#include <algorithm>
+#include <assert.h>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+
+using namespace std;
+
+#include "BackoffModel.h"
+
+//======================================================================
+// BackoffModel
+//
+
+// uint32_t _maxOrder;
+// TokenDictionary _dict;
+// vector<uint8_t> _ends;
+// uint32_t _start;
+// vector<uint32_t> _childOffsets;
+// vector<FrozenEdge> _children;
+// vector<uint32_t> _links;
+// vector<uint8_t> _remaining;
+
+// The remaining tokens of a node at least this far from an end, or that
+// never reaches one.
+static const uint8_t kFarFromEnd = 0xff;
+
+// The trie while it's being built. Nodes are numbered as they're made,
+// and each one's children are found by (parent << 32 | token).
+struct TrieBuilder {
+    vector<uint32_t> _counts;
+    vector<uint32_t> _links;
+    vector<uint8_t> _remaining;
+    unordered_map<uint64_t, uint32_t> _children;
+
+    TrieBuilder() : _counts(1, 0), _links(1, 0), _remaining(1, kFarFromEnd) { }
+
+    // Returns the child of parent for token, making it if it's new, and
+    // counts one more occurrence of it.
+    uint32_t visit(uint32_t parent, TokenId token, uint32_t link) {
+        uint64_t key = static_cast<uint64_t>(parent) << 32 | token;
+        pair<unordered_map<uint64_t, uint32_t>::iterator, bool> found =
+            _children.insert(pair<uint64_t, uint32_t>(key, _counts.size()));
+        if (found.second) {
+            _counts.push_back(0);
+            _links.push_back(link);
+            _remaining.push_back(kFarFromEnd);
+        }
+        uint32_t child = found.first->second;
+        ++_counts[child];
+        return child;
+    }
+};
+
+BackoffModel::BackoffModel(const string& filename, uint32_t maxOrder) : _maxOrder(maxOrder) {
+    assert(maxOrder > 0);
+
+    MappedFile inputFile(filename);
+    assert(inputFile.is_open());
+
+    // active[d] is the node for the last d + 1 tokens of the sentence so
+    // far, the first of which may be the marker. Each token extends
+    // every one of them that's still short enough, and the extension of
+    // active[d] links to the extension of active[d - 1].
+    // Each node visited in the sentence so far, with how many of its
+    // tokens had been read by then, to be told how far that was from its
+    // end once it ends.
+    TrieBuilder trie;
+    _start = trie.visit(0, kNoToken, 0);
+    vector<uint32_t> active(1, _start);
+    vector<uint32_t> next;
+    vector<pair<uint32_t, uint32_t> > visited(1, pair<uint32_t, uint32_t>(_start, 0));
+    uint32_t length = 0;
+
+    TokenStream stream(inputFile.data(), inputFile.size());
+    string_view text;
+    bool ends;
+    while (stream.next(text, ends)) {
+        TokenId token = _dict.intern(text);
+        if (token == _ends.size()) {
+            _ends.push_back(ends);
+        }
+
+        ++length;
+        next.clear();
+        next.push_back(trie.visit(0, token, 0));
+        uint32_t d;
+        for (d = 0; d < active.size() && d < _maxOrder; ++d) {
+            next.push_back(trie.visit(active[d], token, next.back()));
+        }
+        for (d = 0; d < next.size(); ++d) {
+            visited.push_back(pair<uint32_t, uint32_t>(next[d], length));
+        }
+        active.swap(next);
+
+        if (_ends[token]) {
+            size_t i;
+            for (i = 0; i < visited.size(); ++i) {
+                uint8_t& remaining = trie._remaining[visited[i].first];
+                remaining = min<uint32_t>(remaining, length - visited[i].second);
+            }
+            active.assign(1, _start);
+            visited.assign(1, pair<uint32_t, uint32_t>(_start, 0));
+            length = 0;
+        }
+    }
+
+    // Lay the children out flat, each node's in token order
+    size_t nodes = trie._counts.size();
+    vector<pair<uint64_t, uint32_t> > edges(trie._children.begin(), trie._children.end());
+    sort(edges.begin(), edges.end());
+
+    _childOffsets.assign(nodes + 1, 0);
+    _children.reserve(edges.size());
+    uint32_t total = 0;
+    size_t i;
+    for (i = 0; i < edges.size(); ++i) {
+        uint32_t parent = edges[i].first >> 32;
+        if (i == 0 || parent != edges[i - 1].first >> 32) {
+            total = 0;
+        }
+        uint32_t child = edges[i].second;
+        total += trie._counts[child];
+        FrozenEdge edge = { total, child, static_cast<TokenId>(edges[i].first) };
+        _children.push_back(edge);
+        ++_childOffsets[parent + 1];
+    }
+    for (i = 0; i < nodes; ++i) {
+        _childOffsets[i + 1] += _childOffsets[i];
+    }
+    _links.swap(trie._links);
+    _remaining.swap(trie._remaining);
+}
+
+string BackoffModel::buildSentence(uint32_t order, const WalkLimits& limits) const {
+    thread_local Xoshiro256 random(random_device{}());
+
+    string sentence;
+    StringSink sink(sentence);
+    walk(order, random, sink, limits);
+    return sentence;
+}
+
+void BackoffModel::buildSentences(size_t count, uint32_t order, Xoshiro256& random,
+                                  string& out, const WalkLimits& limits) const {
+    StringSink sink(out);
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        walk(order, random, sink, limits);
+        out += '\n';
+    }
+}
+
+void BackoffModel::buildSentences(size_t count, Xoshiro256& random, string& out,
+                                  const WalkLimits& limits) const {
+    buildSentences(count, _maxOrder, random, out, limits);
+}
+
+uint32_t BackoffModel::writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                                     const WalkLimits& limits) const {
+    return walk(_maxOrder, random, sink, limits);
+}
+
+// Returns the number of words it passed to sink.
+template <class Random, class Sink>
+uint32_t BackoffModel::walk(uint32_t order, Random& random, Sink& sink,
+                            const WalkLimits& limits) const {
+    assert(order > 0 && order <= _maxOrder);
+
+    // depth is how many tokens node covers, counting the marker
+    uint32_t node = _start;
+    uint32_t depth = 1;
+    uint32_t words = 0;
+    bool ending = limits._softWords == 0;
+    while (words < limits._maxWords) {
+        // Back off until some shorter context was continued. The empty
+        // one always was, but picking from every word in the text isn't
+        // a continuation of anything, so give up before that.
+        while (_childOffsets[node] == _childOffsets[node + 1] && depth > 1) {
+            node = _links[node];
+            --depth;
+        }
+        if (_childOffsets[node] == _childOffsets[node + 1]) {
+            break;
+        }
+
+        const FrozenEdge* begin = _children.data() + _childOffsets[node];
+        const FrozenEdge* end = _children.data() + _childOffsets[node + 1];
+        const FrozenEdge* edge;
+        uint32_t remaining = ending ? _remaining[node] : kFarFromEnd;
+        if (remaining == kFarFromEnd) {
+            uint32_t r = random.below(end[-1]._cumulative);
+            edge = upper_bound(begin, end, r, [](uint32_t r, const FrozenEdge& e) {
+                return r < e._cumulative;
+            });
+        } else {
+            // The same, among only the children nearer an end, of which
+            // there's always at least one
+            uint32_t total = 0, prev = 0;
+            for (edge = begin; edge != end; prev = edge->_cumulative, ++edge) {
+                if (_remaining[edge->_target] < remaining) {
+                    total += edge->_cumulative - prev;
+                }
+            }
+            uint32_t r = random.below(total);
+            for (edge = begin, prev = 0; ; prev = edge->_cumulative, ++edge) {
+                if (_remaining[edge->_target] < remaining) {
+                    uint32_t count = edge->_cumulative - prev;
+                    if (r < count) {
+                        break;
+                    }
+                    r -= count;
+                }
+            }
+        }
+
+        sink(_dict.word(edge->_token));
+        ++words;
+        if (_ends[edge->_token]) {
+            break;
+        }
+
+        // Slide the context along, dropping its first token once it's
+        // grown past the order
+        node = edge->_target;
+        if (++depth > order) {
+            node = _links[node];
+            --depth;
+        }
+
+        if (!ending) {
+            ending = words >= limits._softWords ||
+                     (words % kDeadlineWords == 0 &&
+                      limits._deadline != chrono::steady_clock::time_point::max() &&
+                      chrono::steady_clock::now() >= limits._deadline);
+        }
+    }
+    return words;
+}
+
+uint32_t BackoffModel::maxOrder() const {
+    return _maxOrder;
+}
+
+uint32_t BackoffModel::n() const {
+    return _maxOrder;
+}
+
+size_t BackoffModel::memoryUsage() const {
+    return sizeof(*this) + _dict.memoryUsage() + _ends.capacity() +
+           _childOffsets.capacity() * sizeof(uint32_t) +
+           _children.capacity() * sizeof(FrozenEdge) +
+           _links.capacity() * sizeof(uint32_t) + _remaining.capacity();
+}
+
+string BackoffModel::describe() const {
+    stringstream ss;
+    ss << "words            " << _dict.size() << endl;
+    ss << "runs             " << _links.size() << " (up to " << _maxOrder + 1
+       << " tokens long)" << endl;
+    ss << "memory           " << memoryUsage() << " bytes" << endl;
+    return ss.str();
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#ifndef SUFFIX_MODEL_HEADER
+#define SUFFIX_MODEL_HEADER
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+
+// Generates the sentences a BackoffModel does at order n, from the text
+// itself rather than from a trie of its runs, so it takes about 8 bytes
+// per token of text whatever n is. So like a BackoffModel, and unlike a
+// SentenceBuilder(n), it picks each word given the n tokens before it,
+// counting one that marks the start of the sentence, and says every
+// sentence through to its last word, even ones of n tokens or fewer.
+// (Where the text stops mid-sentence, this stops too, where a
+// BackoffModel backs off to go on.)
+//
+// The text is kept as one array of token IDs, with kNoToken before each
+// sentence, along with a suffix array: every position in the text,
+// sorted by the n tokens starting there. The occurrences of a context
+// are then a contiguous range of the suffix array, and picking one of
+// them at random picks a successor in proportion to its count.
+//
+// There's nowhere to keep how far a context is from an end, so a walk
+// that WalkLimits has told to end goes on from whichever of a few
+// occurrences, among them the one it's following, has the fewest
+// tokens left in its sentence. That's never more than were left in
+// the one it was following, so it ends within that many words.
+//
+// Any number of threads may generate from one SuffixModel at once.
+class SuffixModel : public SentenceModel {
+  private:
+    uint32_t _n;
+    TokenDictionary _dict;
+    vector<TokenId> _text;
+    vector<uint32_t> _suffixes;
+
+    void sortSuffixes();
+    pair<size_t, size_t> occurrences(uint32_t at, uint32_t length) const;
+    uint32_t remaining(uint32_t at) const;
+    template <class Random, class Sink>
+    uint32_t walk(Random& random, Sink& sink, const WalkLimits& limits) const;
+
+  public:
+    // Constructs a SuffixModel for a given file, where contexts are up
+    // to n tokens long.
+    SuffixModel(const string& filename, uint32_t n);
+
+    // Generates and returns a random sentence, bounded by limits.
+    string buildSentence(const WalkLimits& limits = WalkLimits()) const;
+
+    // Appends count random sentences to out, each followed by a newline
+    // and each bounded by limits on its own.
+    void buildSentences(size_t count, Xoshiro256& random, string& out,
+                        const WalkLimits& limits = WalkLimits()) const override;
+
+    // Generates a random sentence, handing each word to sink as it's
+    // picked, and returns the number of words.
+    uint32_t writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                           const WalkLimits& limits = WalkLimits()) const override;
+
+    // Returns the longest context this model generates from.
+    uint32_t n() const override;
+
+    // Roughly how many bytes this model occupies.
+    size_t memoryUsage() const override;
+
+    // Describes the model's size, one statistic per line.
+    string describe() const override;
+};
+
+#endif // SUFFIX_MODEL_HEADER
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#include <algorithm>
+#include <assert.h>
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+#include "SuffixModel.h"
+
+//======================================================================
+// SuffixModel
+//
+
+// uint32_t _n;
+// TokenDictionary _dict;
+// vector<TokenId> _text;
+// vector<uint32_t> _suffixes;
+
+// Occurrences besides its own an ending walk looks at for a shorter way
+// to an end.
+static const uint32_t kEndingSamples = 8;
+
+SuffixModel::SuffixModel(const string& filename, uint32_t n) : _n(n) {
+    assert(n > 0);
+
+    MappedFile inputFile(filename);
+    assert(inputFile.is_open());
+
+    // Mark the start of each sentence; one that ends the file doesn't
+    // start anything
+    TokenStream stream(inputFile.data(), inputFile.size());
+    string_view text;
+    bool ends;
+    bool starting = true;
+    while (stream.next(text, ends)) {
+        if (starting) {
+            _text.push_back(kNoToken);
+        }
+        _text.push_back(_dict.intern(text));
+        starting = ends;
+    }
+    assert(_text.size() < kNoToken);
+
+    sortSuffixes();
+}
+
+// Prefix doubling: once the suffixes are sorted by their first h tokens,
+// a suffix's rank among them and the rank of the suffix h further on
+// order it by its first 2h. Contexts are never longer than _n tokens, so
+// there's no need to go further than that. A suffix that runs off the
+// end of the text sorts before every one that doesn't.
+void SuffixModel::sortSuffixes() {
+    size_t size = _text.size();
+    _suffixes.resize(size);
+    uint32_t i;
+    for (i = 0; i < size; ++i) {
+        _suffixes[i] = i;
+    }
+    sort(_suffixes.begin(), _suffixes.end(), [&](uint32_t a, uint32_t b) {
+        return _text[a] < _text[b];
+    });
+
+    // Ranks start from 1, leaving 0 for past the end
+    vector<uint32_t> rank(size);
+    vector<uint32_t> next(size);
+    uint32_t distinct = 0;
+    for (i = 0; i < size; ++i) {
+        if (i == 0 || _text[_suffixes[i]] != _text[_suffixes[i - 1]]) {
+            ++distinct;
+        }
+        rank[_suffixes[i]] = distinct;
+    }
+
+    uint32_t h;
+    for (h = 1; h < _n && distinct < size; h *= 2) {
+        auto key = [&](uint32_t s) {
+            uint32_t after = s + h < size ? rank[s + h] : 0;
+            return static_cast<uint64_t>(rank[s]) << 32 | after;
+        };
+        sort(_suffixes.begin(), _suffixes.end(), [&](uint32_t a, uint32_t b) {
+            return key(a) < key(b);
+        });
+
+        distinct = 0;
+        for (i = 0; i < size; ++i) {
+            if (i == 0 || key(_suffixes[i]) != key(_suffixes[i - 1])) {
+                ++distinct;
+            }
+            next[_suffixes[i]] = distinct;
+        }
+        rank.swap(next);
+    }
+}
+
+// Returns the range of _suffixes whose first length tokens are the same
+// as the length tokens starting at at.
+pair<size_t, size_t> SuffixModel::occurrences(uint32_t at, uint32_t length) const {
+    const TokenId* pattern = _text.data() + at;
+    const TokenId* end = _text.data() + _text.size();
+
+    // Compares the suffix at s with the pattern over the pattern's length
+    auto compare = [&](uint32_t s) {
+        const TokenId* ids = _text.data() + s;
+        uint32_t i;
+        for (i = 0; i < length; ++i) {
+            if (ids + i == end) {
+                return -1;
+            }
+            if (ids[i] != pattern[i]) {
+                return ids[i] < pattern[i] ? -1 : 1;
+            }
+        }
+        return 0;
+    };
+
+    vector<uint32_t>::const_iterator lo = partition_point(_suffixes.begin(), _suffixes.end(),
+                                                          [&](uint32_t s) { return compare(s) < 0; });
+    vector<uint32_t>::const_iterator hi = partition_point(lo, _suffixes.end(),
+                                                          [&](uint32_t s) { return compare(s) == 0; });
+    return pair<size_t, size_t>(lo - _suffixes.begin(), hi - _suffixes.begin());
+}
+
+// Returns the number of tokens from at to the end of its sentence.
+uint32_t SuffixModel::remaining(uint32_t at) const {
+    uint32_t end = at;
+    while (end < _text.size() && _text[end] != kNoToken) {
+        ++end;
+    }
+    return end - at;
+}
+
+string SuffixModel::buildSentence(const WalkLimits& limits) const {
+    thread_local Xoshiro256 random(random_device{}());
+
+    string sentence;
+    StringSink sink(sentence);
+    walk(random, sink, limits);
+    return sentence;
+}
+
+void SuffixModel::buildSentences(size_t count, Xoshiro256& random, string& out,
+                                 const WalkLimits& limits) const {
+    StringSink sink(out);
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        walk(random, sink, limits);
+        out += '\n';
+    }
+}
+
+uint32_t SuffixModel::writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                                    const WalkLimits& limits) const {
+    return walk(random, sink, limits);
+}
+
+// The context is always somewhere in the text, so it's kept as the
+// position of one of its occurrences: at first the marker that starts
+// the text's first sentence. Returns the number of words it passed to
+// sink.
+template <class Random, class Sink>
+uint32_t SuffixModel::walk(Random& random, Sink& sink, const WalkLimits& limits) const {
+    if (_text.empty()) {
+        return 0;
+    }
+
+    uint32_t at = 0;
+    uint32_t length = 1;
+    uint32_t words = 0;
+    bool ending = limits._softWords == 0;
+    while (words < limits._maxWords) {
+        pair<size_t, size_t> range = occurrences(at, length);
+        uint32_t pick;
+        if (!ending) {
+            pick = _suffixes[range.first + random.below(range.second - range.first)];
+        } else {
+            pick = at;
+            uint32_t left = remaining(at + length);
+            uint32_t i;
+            for (i = 0; i < kEndingSamples && left != 0; ++i) {
+                uint32_t other = _suffixes[range.first + random.below(range.second - range.first)];
+                uint32_t otherLeft = remaining(other + length);
+                if (otherLeft < left) {
+                    pick = other;
+                    left = otherLeft;
+                }
+            }
+        }
+
+        // The sentence ends where the one it was picked from did
+        size_t next = pick + length;
+        if (next == _text.size() || _text[next] == kNoToken) {
+            break;
+        }
+        sink(_dict.word(_text[next]));
+        ++words;
+
+        at = pick;
+        if (++length > _n) {
+            ++at;
+            --length;
+        }
+
+        if (!ending) {
+            ending = words >= limits._softWords ||
+                     (words % kDeadlineWords == 0 &&
+                      limits._deadline != chrono::steady_clock::time_point::max() &&
+                      chrono::steady_clock::now() >= limits._deadline);
+        }
+    }
+    return words;
+}
+
+uint32_t SuffixModel::n() const {
+    return _n;
+}
+
+size_t SuffixModel::memoryUsage() const {
+    return sizeof(*this) + _dict.memoryUsage() + _text.capacity() * sizeof(TokenId) +
+           _suffixes.capacity() * sizeof(uint32_t);
+}
+
+string SuffixModel::describe() const {
+    stringstream ss;
+    ss << "words            " << _dict.size() << endl;
+    ss << "tokens           " << _text.size() << " (counting one before each sentence)" << endl;
+    ss << "memory           " << memoryUsage() << " bytes" << endl;
+    return ss.str();
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#ifndef COMPACT_MODEL_HEADER
+#define COMPACT_MODEL_HEADER
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+
+// How much a CompactModel gives up to be small.
+struct CompactOptions {
+    uint32_t _minCount;     // Edges seen fewer times than this are pruned
+    uint32_t _weightBits;   // 8 or 16, the bits each edge's count is kept in
+
+    CompactOptions() : _minCount(1), _weightBits(16) { }
+};
+
+// A SentenceBuilder's model squeezed for hosts that can't hold the full
+// one. Edges seen fewer than a minimum number of times are pruned,
+// counts are scaled down to fit 8 or 16 bits, and successors are stored
+// as varints of how far their gram numbers are from their
+// predecessor's. Generating samples it in place, decoding only the
+// edges of the gram the walk is at. The few grams with many successors,
+// like the root, keep running totals and successors at full width
+// instead, so that picking one is a binary search rather than a scan.
+//
+// Each gram keeps the most common of its edges toward an end if pruning
+// would leave it none, so walks still end, and only where the text did.
+// Grams no walk can reach any more are dropped. Each also keeps its
+// distance from an end in a byte, which is all WalkLimits needs: a walk
+// that's ending takes only edges to grams nearer an end, except from
+// grams 255 or more steps from one, which it leaves as usual.
+//
+// Any number of threads may generate from one CompactModel at once.
+class CompactModel : public SentenceModel {
+  private:
+    uint32_t _n;
+    uint32_t _weightBits;
+    uint64_t _edgeCount;
+    double _fidelity;
+
+    // The edges out of gram g start at _edges[_edgeOffsets[g]]: their
+    // number, shifted up past a bit that says they're wide, and their
+    // total weight, as varints. Then each one's weight in _weightBits and
+    // each one's successor minus g, zigzagged and as a varint; or if
+    // they're wide, each one's running total and then each one's
+    // successor, in 4 bytes. Gram 0 is the root; _tokens[g] is the last
+    // token of g.
+    string _wordChars;
+    vector<uint32_t> _wordOffsets;
+    vector<TokenId> _tokens;
+    vector<uint32_t> _edgeOffsets;
+    vector<uint8_t> _edges;
+    vector<uint8_t> _endDistances;
+
+    template <class Random> bool advance(uint32_t& curr, bool ending, Random& random) const;
+    template <class Random, class Sink>
+    uint32_t walk(Random& random, Sink& sink, const WalkLimits& limits) const;
+
+  public:
+    // Compacts the model of sb, which needn't outlive this.
+    CompactModel(const SentenceBuilder& sb, const CompactOptions& options);
+
+    // Compacts the model SentenceBuilder::create(filename, n) would
+    // build, without keeping it: it's only in memory, alongside this,
+    // until this has been made from it.
+    CompactModel(const string& filename, uint32_t n, const CompactOptions& options);
+
+    // Generates a random sentence the way sb would have, bounded by
+    // limits.
+    string buildSentence(const WalkLimits& limits = WalkLimits()) const;
+
+    // Appends count random sentences to out, each followed by a newline.
+    // Each sentence is bounded by limits on its own.
+    void buildSentences(size_t count, Xoshiro256& random, string& out,
+                        const WalkLimits& limits = WalkLimits()) const override;
+
+    // Generates a random sentence, handing each word to sink as it's
+    // picked, and returns the number of words.
+    uint32_t writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                           const WalkLimits& limits = WalkLimits()) const override;
+
+    // Returns the order of the model it was made from.
+    uint32_t n() const override;
+
+    // Returns the number of grams and edges that were kept.
+    uint64_t gramCount() const;
+    uint64_t edgeCount() const;
+
+    // Roughly how many bytes this model occupies.
+    size_t memoryUsage() const override;
+
+    // Describes the model's size and fidelity, one per line.
+    string describe() const override;
+
+    // How closely this model follows the one it was made from, from 0
+    // to 1: one minus the total variation distance between a gram's
+    // successors here and there, averaged over the original grams as
+    // often as the text left them. Dropped grams count as 0.
+    double fidelity() const;
+};
+
+#endif // COMPACT_MODEL_HEADER
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#include <algorithm>
+#include <assert.h>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+#include "CompactModel.h"
+
+//======================================================================
+// CompactModel
+//
+
+// uint32_t _n;
+// uint32_t _weightBits;
+// uint64_t _edgeCount;
+// double _fidelity;
+// string _wordChars;
+// vector<uint32_t> _wordOffsets;
+// vector<TokenId> _tokens;
+// vector<uint32_t> _edgeOffsets;
+// vector<uint8_t> _edges;
+// vector<uint8_t> _endDistances;
+
+// Marks the grams of the original model that were dropped.
+static const uint32_t kDropped = 0xffffffff;
+
+// Grams with more successors than this store them wide.
+static const uint32_t kMaxNarrowDegree = 16;
+
+// The end distance of a gram at least this far from an end, or that
+// never reaches one.
+static const uint8_t kFarFromEnd = 0xff;
+
+static void putVarint(vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+static uint64_t getVarint(const uint8_t*& in) {
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    while (*in & 0x80) {
+        value |= static_cast<uint64_t>(*in++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return value | static_cast<uint64_t>(*in++) << shift;
+}
+
+// Interleaves negative differences with positive ones, so small ones
+// of either sign make short varints.
+static uint64_t zigzag(int64_t value) {
+    return static_cast<uint64_t>(value) << 1 ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static void putWide(vector<uint8_t>& out, uint32_t value) {
+    uint32_t i;
+    for (i = 0; i < 4; ++i) {
+        out.push_back(static_cast<uint8_t>(value >> 8 * i));
+    }
+}
+
+// Returns the i-th of the wide values starting at in.
+static uint32_t getWide(const uint8_t* in, uint32_t i) {
+    in += 4 * i;
+    return in[0] | in[1] << 8 | in[2] << 16 | static_cast<uint32_t>(in[3]) << 24;
+}
+
+static shared_ptr<SentenceBuilder> createGraph(string filename, uint32_t n) {
+    return SentenceBuilder::create(filename, n);
+}
+
+CompactModel::CompactModel(const string& filename, uint32_t n, const CompactOptions& options)
+    : CompactModel(*createGraph(filename, n), options) { }
+
+CompactModel::CompactModel(const SentenceBuilder& sb, const CompactOptions& options)
+    : _n(sb.n()), _weightBits(options._weightBits), _edgeCount(0), _fidelity(0) {
+    assert(_weightBits == 8 || _weightBits == 16);
+    const FrozenModel& m = sb.frozen();
+    uint32_t maxWeight = (1u << _weightBits) - 1;
+
+    // The edges each gram keeps. Among them is always one that brings
+    // a walk closer to an end, if the gram had any, so pruning can't
+    // leave a walk going round in circles.
+    vector<uint8_t> kept(m._edgeCount, 0);
+    uint64_t g;
+    uint32_t e;
+    for (g = 0; g < m._gramCount; ++g) {
+        uint32_t begin = m._edgeOffsets[g], end = m._edgeOffsets[g + 1];
+        uint32_t prev = 0, best = end, bestCount = 0;
+        bool ends = false;
+        for (e = begin; e < end; prev = m._edges[e]._cumulative, ++e) {
+            uint32_t count = m._edges[e]._cumulative - prev;
+            bool closer = m._endDistances[m._edges[e]._target] < m._endDistances[g];
+            kept[e] = count >= options._minCount;
+            ends = ends || (kept[e] && closer);
+            if (closer && count > bestCount) {
+                best = e;
+                bestCount = count;
+            }
+        }
+        if (!ends && best != end) {
+            kept[best] = 1;
+        }
+    }
+
+    // Renumber what's still reachable breadth-first from the root, as
+    // the original was, so successors stay close to their predecessors
+    vector<uint32_t> renumbered(m._gramCount, kDropped);
+    vector<uint32_t> order(1, 0);
+    renumbered[0] = 0;
+    _tokens.assign(1, kNoToken);
+    size_t i;
+    for (i = 0; i < order.size(); ++i) {
+        for (e = m._edgeOffsets[order[i]]; e < m._edgeOffsets[order[i] + 1]; ++e) {
+            uint32_t target = m._edges[e]._target;
+            if (kept[e] && renumbered[target] == kDropped) {
+                renumbered[target] = order.size();
+                order.push_back(target);
+                _tokens.push_back(m._edges[e]._token);
+            }
+        }
+    }
+
+    assert(m._wordOffsets[m._wordCount] <= UINT32_MAX);
+    _wordChars.assign(m._wordChars, m._wordOffsets[m._wordCount]);
+    _wordOffsets.assign(m._wordOffsets, m._wordOffsets + m._wordCount + 1);
+    _edgeOffsets.reserve(order.size());
+
+    // The original distances still hold for walks that only take edges
+    // nearer an end, since each gram kept one of those if it had any
+    _endDistances.resize(order.size());
+    for (i = 0; i < order.size(); ++i) {
+        _endDistances[i] = min<uint32_t>(m._endDistances[order[i]], kFarFromEnd);
+    }
+
+    // Encode each gram's edges, scaling their counts down only if the
+    // largest doesn't fit, and compare its distribution to the original
+    vector<uint32_t> weights;
+    double distance = 0, occurrences = 0;
+    for (i = 0; i < order.size(); ++i) {
+        uint32_t begin = m._edgeOffsets[order[i]], end = m._edgeOffsets[order[i] + 1];
+        uint32_t prev = 0, largest = 0;
+        for (e = begin; e < end; prev = m._edges[e]._cumulative, ++e) {
+            if (kept[e]) {
+                largest = max(largest, m._edges[e]._cumulative - prev);
+            }
+        }
+        weights.clear();
+        uint32_t total = 0;
+        for (e = begin, prev = 0; e < end; prev = m._edges[e]._cumulative, ++e) {
+            if (kept[e]) {
+                uint64_t count = m._edges[e]._cumulative - prev;
+                uint32_t weight = largest <= maxWeight ? count :
+                    max<uint64_t>(1, (count * maxWeight + largest / 2) / largest);
+                weights.push_back(weight);
+                total += weight;
+            }
+        }
+
+        _edgeOffsets.push_back(_edges.size());
+        bool wide = weights.size() > kMaxNarrowDegree;
+        putVarint(_edges, weights.size() << 1 | wide);
+        if (weights.empty()) {
+            continue;
+        }
+        putVarint(_edges, total);
+        uint32_t w;
+        uint32_t running = 0;
+        for (w = 0; w < weights.size(); ++w) {
+            if (wide) {
+                running += weights[w];
+                putWide(_edges, running);
+            } else {
+                _edges.push_back(static_cast<uint8_t>(weights[w]));
+                if (_weightBits == 16) {
+                    _edges.push_back(static_cast<uint8_t>(weights[w] >> 8));
+                }
+            }
+        }
+        for (e = begin; e < end; ++e) {
+            if (kept[e] && wide) {
+                putWide(_edges, renumbered[m._edges[e]._target]);
+            } else if (kept[e]) {
+                int64_t delta = static_cast<int64_t>(renumbered[m._edges[e]._target]) - i;
+                putVarint(_edges, zigzag(delta));
+            }
+        }
+        _edgeCount += weights.size();
+
+        double original = m._edges[end - 1]._cumulative;
+        double gap = 0;
+        for (e = begin, prev = 0, w = 0; e < end; prev = m._edges[e]._cumulative, ++e) {
+            double p = (m._edges[e]._cumulative - prev) / original;
+            double q = kept[e] ? static_cast<double>(weights[w++]) / total : 0;
+            gap += p > q ? p - q : q - p;
+        }
+        distance += gap / 2 * original;
+    }
+    assert(_edges.size() <= UINT32_MAX);
+
+    // Dropped grams differ completely
+    for (g = 0; g < m._gramCount; ++g) {
+        uint32_t begin = m._edgeOffsets[g], end = m._edgeOffsets[g + 1];
+        if (begin != end) {
+            occurrences += m._edges[end - 1]._cumulative;
+            if (renumbered[g] == kDropped) {
+                distance += m._edges[end - 1]._cumulative;
+            }
+        }
+    }
+    _fidelity = occurrences == 0 ? 1 : 1 - distance / occurrences;
+}
+
+string CompactModel::buildSentence(const WalkLimits& limits) const {
+    thread_local Xoshiro256 random(random_device{}());
+    string sentence;
+    StringSink sink(sentence);
+    walk(random, sink, limits);
+    return sentence;
+}
+
+void CompactModel::buildSentences(size_t count, Xoshiro256& random, string& out,
+                                  const WalkLimits& limits) const {
+    StringSink sink(out);
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        walk(random, sink, limits);
+        out += '\n';
+    }
+}
+
+uint32_t CompactModel::writeSentence(Xoshiro256& random, const function<void(string_view)>& sink,
+                                     const WalkLimits& limits) const {
+    return walk(random, sink, limits);
+}
+
+// Moves curr to a successor picked in proportion to its weight, only
+// from among those nearer an end if ending and curr is near enough to
+// one. Returns false, leaving curr alone, if curr has no successors.
+template <class Random>
+bool CompactModel::advance(uint32_t& curr, bool ending, Random& random) const {
+    const uint8_t* in = _edges.data() + _edgeOffsets[curr];
+    uint64_t header = getVarint(in);
+    uint32_t degree = header >> 1;
+    if (degree == 0) {
+        return false;
+    }
+    uint32_t total = getVarint(in);
+    uint32_t distance = ending ? _endDistances[curr] : kFarFromEnd;
+
+    if (header & 1) {
+        const uint8_t* targets = in + 4 * degree;
+        uint32_t k;
+        if (distance == kFarFromEnd) {
+            // The first edge whose running total exceeds r owns it
+            uint32_t r = random.below(total);
+            uint32_t lo = 0, hi = degree - 1;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (getWide(in, mid) > r) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            curr = getWide(targets, lo);
+            return true;
+        }
+
+        uint32_t nearer = 0, prev = 0;
+        for (k = 0; k < degree; prev = getWide(in, k), ++k) {
+            if (_endDistances[getWide(targets, k)] < distance) {
+                nearer += getWide(in, k) - prev;
+            }
+        }
+        uint32_t r = random.below(nearer);
+        for (k = 0, prev = 0; ; prev = getWide(in, k), ++k) {
+            uint32_t target = getWide(targets, k);
+            if (_endDistances[target] < distance) {
+                uint32_t weight = getWide(in, k) - prev;
+                if (r < weight) {
+                    curr = target;
+                    return true;
+                }
+                r -= weight;
+            }
+        }
+    }
+
+    // Narrow edges are few enough to scan
+    uint32_t k = 0;
+    if (distance == kFarFromEnd) {
+        // Find the edge that owns occurrence r among the weights, then
+        // skip the successors before it
+        uint32_t r = random.below(total);
+        if (_weightBits == 8) {
+            while (r >= in[k]) {
+                r -= in[k++];
+            }
+            in += degree;
+        } else {
+            uint32_t weight;
+            while (r >= (weight = in[2 * k] | in[2 * k + 1] << 8)) {
+                r -= weight;
+                ++k;
+            }
+            in += 2 * degree;
+        }
+        while (k-- > 0) {
+            while (*in++ & 0x80) { }
+        }
+        curr += unzigzag(getVarint(in));
+        return true;
+    }
+
+    // Ending, the successors are all needed to tell which are nearer
+    uint32_t weights[kMaxNarrowDegree];
+    uint32_t targets[kMaxNarrowDegree];
+    for (k = 0; k < degree; ++k) {
+        weights[k] = _weightBits == 8 ? in[k] : in[2 * k] | in[2 * k + 1] << 8;
+    }
+    in += degree * _weightBits / 8;
+    uint32_t nearer = 0;
+    for (k = 0; k < degree; ++k) {
+        targets[k] = curr + unzigzag(getVarint(in));
+        if (_endDistances[targets[k]] < distance) {
+            nearer += weights[k];
+        }
+    }
+    uint32_t r = random.below(nearer);
+    for (k = 0; ; ++k) {
+        if (_endDistances[targets[k]] < distance) {
+            if (r < weights[k]) {
+                break;
+            }
+            r -= weights[k];
+        }
+    }
+    curr = targets[k];
+    return true;
+}
+
+// Returns the number of words it passed to sink.
+template <class Random, class Sink>
+uint32_t CompactModel::walk(Random& random, Sink& sink, const WalkLimits& limits) const {
+    uint32_t curr = 0;
+    uint32_t words = 0;
+    bool ending = limits._softWords == 0;
+    while (words < limits._maxWords && advance(curr, ending, random)) {
+        TokenId token = _tokens[curr];
+        sink(string_view(_wordChars.data() + _wordOffsets[token],
+                         _wordOffsets[token + 1] - _wordOffsets[token]));
+        ++words;
+
+        if (!ending) {
+            ending = words >= limits._softWords ||
+                     (words % kDeadlineWords == 0 &&
+                      limits._deadline != chrono::steady_clock::time_point::max() &&
+                      chrono::steady_clock::now() >= limits._deadline);
+        }
+    }
+    return words;
+}
+
+uint32_t CompactModel::n() const {
+    return _n;
+}
+
+uint64_t CompactModel::gramCount() const {
+    return _tokens.size() - 1;
+}
+
+uint64_t CompactModel::edgeCount() const {
+    return _edgeCount;
+}
+
+size_t CompactModel::memoryUsage() const {
+    return sizeof(*this) + _wordChars.capacity() + _wordOffsets.capacity() * sizeof(uint32_t) +
+           _tokens.capacity() * sizeof(TokenId) + _edgeOffsets.capacity() * sizeof(uint32_t) +
+           _edges.capacity() + _endDistances.capacity();
+}
+
+double CompactModel::fidelity() const {
+    return _fidelity;
+}
+
+string CompactModel::describe() const {
+    stringstream ss;
+    ss << fixed << setprecision(4);
+    ss << "grams            " << gramCount() << endl;
+    ss << "edges            " << edgeCount() << " (" << _weightBits << "-bit weights)" << endl;
+    ss << "memory           " << memoryUsage() << " bytes" << endl;
+    ss << "fidelity         " << _fidelity << endl;
+    return ss.str();
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#ifndef MODEL_CACHE_HEADER
+#define MODEL_CACHE_HEADER
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+
+// The kinds of model a ModelCache can build.
+enum ModelKind {
+    kGraphModel,            // SentenceBuilder
+    kCompactModel,          // CompactModel, made from a SentenceBuilder
+    kBackoffModel,          // BackoffModel, generating at order n
+    kSuffixModel,           // SuffixModel
+};
+
+// The models a program can generate from, by name, each built (or
+// loaded from its snapshot) the first time it's asked for. Once the
+// models in memory add up to more than a budget, the least recently
+// used ones are dropped, to be rebuilt if they're wanted again. Anyone
+// still holding a dropped model can keep using it until they let go.
+//
+// A name that isn't a model's, like "hugo+kafka*2", asks for a blend:
+// the models it names merged, each weighted by the number after its *
+// if it has one. Once asked for, a blend is a model like any other,
+// listed under one spelling however it was asked for ("kafka*2+hugo"
+// and "hugo*2+kafka*4" are both "hugo+kafka*2"). Only the most
+// recently used few blends are kept, so that asking for every blend
+// there is can't use up memory. Only graphs can be blended.
+//
+// Snapshots are of graphs, so compact models are made from a graph
+// loaded from one, or built and saved to one, and the graph is dropped
+// as soon as the model has been made. Backoff and suffix models are
+// built from their texts every time.
+//
+// Any number of threads may use a ModelCache at once. Building one
+// model doesn't hold up requests for the others.
+class ModelCache {
+  private:
+    struct Entry {
+        string _filename;
+        vector<pair<string, uint32_t> > _parts;     // For a blend, its models and their weights
+        mutex _building;
+        shared_ptr<SentenceModel> _model;
+        size_t _bytes;
+        list<Entry*>::iterator _recent;     // Only meaningful while _model is set
+        uint32_t _users;                    // Threads in get() for it, which keep a blend
+
+        Entry(const string& filename) : _filename(filename), _bytes(0), _users(0) { }
+    };
+
+    uint32_t _n;
+    string _snapshotDir;
+    size_t _budget;
+    ModelKind _kind;
+
+    // Guards everything below, and every Entry but its _building and
+    // _filename
+    mutable mutex _lock;
+    map<string, unique_ptr<Entry> > _entries;
+    list<Entry*> _recent;                   // Loaded models, most recently used first
+    size_t _bytes;
+    uint32_t _blends;                       // Entries in _entries that are blends
+
+    Entry* addBlend(const string& name);
+    void dropBlend();
+    void release(Entry* entry, bool keep);
+    shared_ptr<SentenceModel> build(const string& name, const Entry& entry);
+    shared_ptr<SentenceBuilder> buildGraph(const string& name, const Entry& entry);
+    void evict(const Entry* keep);
+
+  public:
+    // Models will track n-grams of length n. If snapshotDir isn't empty,
+    // models are loaded from snapshots there when they're up to date,
+    // and saved there when they aren't. A budget of 0 bytes never drops
+    // anything. Every model is of the given kind.
+    ModelCache(uint32_t n, const string& snapshotDir, size_t budget,
+               ModelKind kind = kGraphModel);
+
+    // Makes the model in filename available as name. Nothing is read
+    // until the model is first asked for.
+    void add(const string& name, const string& filename);
+
+    // Returns the names of every model, loaded or not, in order.
+    vector<string> names() const;
+
+    // Returns the model called name, building it first if it isn't in
+    // memory, or NULL if there's no such model or blend, or the blend's
+    // weights are too large for its models' counts.
+    shared_ptr<SentenceModel> get(const string& name);
+
+    // Returns the model called name if it's in memory, and NULL if it
+    // isn't, or get() would have to work out what it is. Never builds
+    // anything, so it's quick enough for an event loop.
+    shared_ptr<SentenceModel> find(const string& name);
+
+    // Returns the number of models in memory and roughly how many bytes
+    // they occupy.
+    size_t loaded() const;
+    size_t bytes() const;
+};
+
+#endif // MODEL_CACHE_HEADER
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#include <iostream>
+#include <cstdlib>
+#include <numeric>
+#include <sys/stat.h>
+
+using namespace std;
+
+#include "ModelCache.h"
+#include "BackoffModel.h"
+#include "CompactModel.h"
+#include "SuffixModel.h"
+
+static bool isNewer(const string& filename, const string& than);
+
+//======================================================================
+// ModelCache
+//
+
+// uint32_t _n;
+// string _snapshotDir;
+// size_t _budget;
+// ModelKind _kind;
+// mutable mutex _lock;
+// map<string, unique_ptr<Entry> > _entries;
+// list<Entry*> _recent;
+// size_t _bytes;
+// uint32_t _blends;
+
+// Blends kept at once.
+static const uint32_t kMaxBlends = 64;
+
+ModelCache::ModelCache(uint32_t n, const string& snapshotDir, size_t budget, ModelKind kind)
+    : _n(n), _snapshotDir(snapshotDir), _budget(budget), _kind(kind), _bytes(0), _blends(0) { }
+
+void ModelCache::add(const string& name, const string& filename) {
+    lock_guard<mutex> lock(_lock);
+    _entries[name].reset(new Entry(filename));
+}
+
+vector<string> ModelCache::names() const {
+    lock_guard<mutex> lock(_lock);
+    vector<string> names;
+    map<string, unique_ptr<Entry> >::const_iterator it;
+    for (it = _entries.begin(); it != _entries.end(); ++it) {
+        names.push_back(it->first);
+    }
+    return names;
+}
+
+shared_ptr<SentenceModel> ModelCache::find(const string& name) {
+    lock_guard<mutex> lock(_lock);
+    map<string, unique_ptr<Entry> >::iterator it = _entries.find(name);
+    if (it == _entries.end() || !it->second->_model) {
+        return NULL;
+    }
+    Entry* entry = it->second.get();
+    _recent.splice(_recent.begin(), _recent, entry->_recent);
+    return entry->_model;
+}
+
+shared_ptr<SentenceModel> ModelCache::get(const string& name) {
+    Entry* entry;
+    {
+        lock_guard<mutex> lock(_lock);
+        map<string, unique_ptr<Entry> >::iterator it = _entries.find(name);
+        if (it != _entries.end()) {
+            entry = it->second.get();
+        } else if (_kind != kGraphModel || (entry = addBlend(name)) == NULL) {
+            return NULL;
+        }
+        if (entry->_model) {
+            _recent.splice(_recent.begin(), _recent, entry->_recent);
+            return entry->_model;
+        }
+        ++entry->_users;
+    }
+
+    // Only one thread builds a given model; the rest wait for it here,
+    // and find it built once they get in
+    shared_ptr<SentenceModel> sb;
+    {
+        lock_guard<mutex> building(entry->_building);
+        {
+            lock_guard<mutex> lock(_lock);
+            sb = entry->_model;
+            if (sb) {
+                _recent.splice(_recent.begin(), _recent, entry->_recent);
+            }
+        }
+        if (!sb) {
+            sb = build(name, *entry);
+        }
+        if (sb && !entry->_model) {
+            lock_guard<mutex> lock(_lock);
+            entry->_model = sb;
+            entry->_bytes = sb->memoryUsage();
+            entry->_recent = _recent.insert(_recent.begin(), entry);
+            _bytes += entry->_bytes;
+            evict(entry);
+        }
+    }
+
+    // A blend that couldn't be made isn't kept
+    lock_guard<mutex> lock(_lock);
+    release(entry, sb != NULL);
+    return sb;
+}
+
+size_t ModelCache::loaded() const {
+    lock_guard<mutex> lock(_lock);
+    return _recent.size();
+}
+
+size_t ModelCache::bytes() const {
+    lock_guard<mutex> lock(_lock);
+    return _bytes;
+}
+
+// Spells a model's name as a single file name, since names may be paths.
+static string flatten(const string& name) {
+    string flat;
+    uint32_t i;
+    for (i = 0; i < name.size(); ++i) {
+        if (name[i] == '/') {
+            flat += "%2F";
+        } else if (name[i] == '%') {
+            flat += "%25";
+        } else {
+            flat += name[i];
+        }
+    }
+    return flat;
+}
+
+// Returns the entry for the blend called name, making one if need be,
+// or NULL if name isn't one: "model[*weight]" joined by '+', naming
+// only models that were added. A blend that comes to just one model is
+// that model. Needs _lock.
+ModelCache::Entry* ModelCache::addBlend(const string& name) {
+    // Weights by model, summed over every time it's named
+    map<string, uint64_t> weights;
+    size_t begin = 0;
+    while (begin <= name.size()) {
+        size_t end = min(name.find('+', begin), name.size());
+        string part = name.substr(begin, end - begin);
+        uint64_t weight = 1;
+        size_t star = part.find('*');
+        if (star != string::npos) {
+            string number = part.substr(star + 1);
+            char* rest;
+            unsigned long parsed = strtoul(number.c_str(), &rest, 10);
+            if (number.empty() || *rest != '\0' || parsed == 0 || parsed > UINT32_MAX) {
+                return NULL;
+            }
+            weight = parsed;
+            part.erase(star);
+        }
+        map<string, unique_ptr<Entry> >::const_iterator it = _entries.find(part);
+        if (it == _entries.end() || !it->second->_parts.empty()) {
+            return NULL;
+        }
+        weights[part] += weight;
+        if (weights[part] > UINT32_MAX) {
+            return NULL;
+        }
+        begin = end + 1;
+    }
+
+    // Only the weights' ratios matter, so they're reduced, and the blend
+    // is spelled in order of its models' names
+    uint64_t divisor = 0;
+    map<string, uint64_t>::iterator w;
+    for (w = weights.begin(); w != weights.end(); ++w) {
+        divisor = gcd(divisor, w->second);
+    }
+    vector<pair<string, uint32_t> > parts;
+    string canonical;
+    for (w = weights.begin(); w != weights.end(); ++w) {
+        parts.push_back(pair<string, uint32_t>(w->first, w->second / divisor));
+        canonical += (canonical.empty() ? "" : "+") + w->first;
+        if (parts.back().second != 1) {
+            canonical += "*" + to_string(parts.back().second);
+        }
+    }
+    map<string, unique_ptr<Entry> >::iterator it = _entries.find(canonical);
+    if (it != _entries.end()) {
+        return it->second.get();
+    }
+
+    if (_blends >= kMaxBlends) {
+        dropBlend();
+    }
+    Entry* entry = new Entry("");
+    entry->_parts = parts;
+    _entries[canonical].reset(entry);
+    ++_blends;
+    return entry;
+}
+
+// Forgets a blend no thread is using, preferring one that isn't in
+// memory, and otherwise the least recently used. If every blend is in
+// use, keeps them all. Needs _lock.
+void ModelCache::dropBlend() {
+    const Entry* oldest = NULL;
+    list<Entry*>::reverse_iterator r;
+    for (r = _recent.rbegin(); r != _recent.rend() && oldest == NULL; ++r) {
+        if (!(*r)->_parts.empty() && (*r)->_users == 0) {
+            oldest = *r;
+        }
+    }
+
+    map<string, unique_ptr<Entry> >::iterator it, victim = _entries.end();
+    for (it = _entries.begin(); it != _entries.end(); ++it) {
+        const Entry* entry = it->second.get();
+        if (entry->_parts.empty() || entry->_users != 0) {
+            continue;
+        }
+        if (!entry->_model) {
+            victim = it;
+            break;
+        }
+        if (entry == oldest) {
+            victim = it;
+        }
+    }
+    if (victim == _entries.end()) {
+        return;
+    }
+
+    Entry* entry = victim->second.get();
+    if (entry->_model) {
+        _recent.erase(entry->_recent);
+        _bytes -= entry->_bytes;
+    }
+    _entries.erase(victim);
+    --_blends;
+}
+
+// Lets go of an entry get() was using. Unless keep is set, a blend that
+// nothing else is using and that isn't in memory is forgotten. Needs
+// _lock.
+void ModelCache::release(Entry* entry, bool keep) {
+    --entry->_users;
+    if (keep || entry->_parts.empty() || entry->_users != 0 || entry->_model) {
+        return;
+    }
+    map<string, unique_ptr<Entry> >::iterator it;
+    for (it = _entries.begin(); it != _entries.end(); ++it) {
+        if (it->second.get() == entry) {
+            _entries.erase(it);
+            --_blends;
+            return;
+        }
+    }
+}
+
+// Makes the model from its graph, which is only kept if it's the model,
+// or straight from its text if it has no graph.
+shared_ptr<SentenceModel> ModelCache::build(const string& name, const Entry& entry) {
+    if (_kind == kBackoffModel) {
+        return make_shared<BackoffModel>(entry._filename, _n);
+    }
+    if (_kind == kSuffixModel) {
+        return make_shared<SuffixModel>(entry._filename, _n);
+    }
+    shared_ptr<SentenceBuilder> graph = buildGraph(name, entry);
+    if (!graph || _kind == kGraphModel) {
+        return graph;
+    }
+    return make_shared<CompactModel>(*graph, CompactOptions());
+}
+
+// Prefers an up-to-date snapshot of the model over rebuilding it, and
+// leaves one behind for next time if there wasn't. A blend is merged
+// from its parts instead, which are built first if need be.
+shared_ptr<SentenceBuilder> ModelCache::buildGraph(const string& name, const Entry& entry) {
+    if (!entry._parts.empty()) {
+        // Holding the parts keeps them alive while they're merged, even if
+        // the cache drops them. Blends are only made of graphs, so that's
+        // what the parts are.
+        vector<shared_ptr<SentenceModel> > held;
+        vector<const SentenceBuilder*> models;
+        vector<uint32_t> weights;
+        uint32_t i;
+        for (i = 0; i < entry._parts.size(); ++i) {
+            held.push_back(get(entry._parts[i].first));
+            models.push_back(static_cast<const SentenceBuilder*>(held.back().get()));
+            weights.push_back(entry._parts[i].second);
+        }
+        return SentenceBuilder::merge(models, weights);
+    }
+
+    shared_ptr<SentenceBuilder> sb;
+    string snapshot;
+    if (!_snapshotDir.empty()) {
+        snapshot = _snapshotDir + "/" + flatten(name) + "." + to_string(_n) + ".snapshot";
+        if (isNewer(snapshot, entry._filename)) {
+            sb = SentenceBuilder::load(snapshot);
+        }
+    }
+    if (!sb || sb->n() != _n) {
+        string filename = entry._filename;
+        sb = SentenceBuilder::create(filename, _n);
+        if (!snapshot.empty() && !sb->save(snapshot)) {
+            cerr << "Couldn't write snapshot " << snapshot << endl;
+        }
+    }
+    return sb;
+}
+
+// Drops the least recently used models other than keep until the rest
+// fit in the budget. Must be called holding _lock.
+void ModelCache::evict(const Entry* keep) {
+    while (_budget != 0 && _bytes > _budget && _recent.back() != keep) {
+        Entry* victim = _recent.back();
+        _recent.pop_back();
+        _bytes -= victim->_bytes;
+        victim->_bytes = 0;
+        victim->_model.reset();
+    }
+}
+
+// Returns true if filename exists and was modified after than was.
+static bool isNewer(const string& filename, const string& than) {
+    struct stat a, b;
+    if (stat(filename.c_str(), &a) != 0 || stat(than.c_str(), &b) != 0) {
+        return false;
+    }
+    return a.st_mtime > b.st_mtime;
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#ifndef SENTENCE_SERVER_HEADER
+#define SENTENCE_SERVER_HEADER
+
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+#include "ModelCache.h"
+
+struct Connection;
+struct EventLoop;
+struct BuildQueue;
+
+// Serves sentences from a set of models over TCP.
+//
+// Each request is one line, "model,count", or just "model" for a
+// single sentence. Its reply is an "OK count" line followed by count
+// sentences, one per line, or else a single "ERR reason" line. Very
+// long sentences are steered to an end, or cut off. Clients may send
+// any number of requests without waiting for replies; the replies come
+// back in the order the requests were sent. A request for a model
+// that isn't in memory waits while it's built on a thread of its own,
+// along with the requests sent after it on the same connection; other
+// connections carry on.
+class SentenceServer {
+  private:
+    ModelCache& _models;
+    uint16_t _port;
+    uint32_t _threads;
+
+    int listen() const;
+    void loop(EventLoop& loop) const;
+    void accept(int listener, int epoll, int& spare) const;
+    void resume(EventLoop& loop, Xoshiro256& random) const;
+    void settle(EventLoop& loop, Connection* conn) const;
+    void builder(BuildQueue& builds) const;
+    void serve(Connection& conn, EventLoop& loop, Xoshiro256& random) const;
+    void flush(Connection& conn) const;
+    void fail(Connection& conn) const;
+    void handle(string_view request, Connection& conn, EventLoop& loop, Xoshiro256& random) const;
+    void answer(Connection& conn, Xoshiro256& random) const;
+
+  public:
+    // Serves the models in models, which must outlive the server.
+    SentenceServer(ModelCache& models, uint16_t port, uint32_t threads);
+
+    // Serves forever, with one event loop per thread each accepting its
+    // own share of the connections. Returns false if it can't listen.
+    bool run() const;
+};
+
+#endif // SENTENCE_SERVER_HEADER
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#include <iostream>
+#include <thread>
+#include <random>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+#include "SentenceServer.h"
+
+// Longest request line answered. A longer complete line is refused,
+// and a longer unfinished one ends the connection.
+static const size_t kMaxRequestBytes = 4 << 10;
+
+// Most sentences one request may ask for.
+static const uint32_t kMaxCount = 100000;
+
+// Words after which a sentence heads for its end, and at which it's
+// cut off, so one cyclic model can't hold up a whole event loop.
+static const uint32_t kSoftWords = 100;
+static const uint32_t kMaxWords = 1000;
+
+// Once this many reply bytes are waiting to be sent, a connection's
+// further requests wait until the client catches up. So does the rest
+// of a long reply, which is generated this many sentences at a time.
+static const size_t kMaxPendingBytes = 4 << 20;
+static const uint32_t kChunkSentences = 16;
+
+// Events handled per call to epoll_wait.
+static const int kMaxEvents = 256;
+
+// How long a loop waits before accepting again when it's out of
+// descriptors and has none spare.
+static const int kAcceptBackoffMillis = 10;
+
+// The state of one client connection.
+struct Connection {
+    int _fd;
+    uint32_t _events;   // What epoll is currently watching for
+    string _in;         // Bytes received but not yet handled
+    size_t _parsed;     // How much of _in has been handled
+    string _out;        // Replies not yet sent
+    size_t _sent;       // How much of _out has been sent
+    bool _eof;          // The client has finished sending
+    bool _tooLong;      // Its last request was too long, and is owed an ERR
+
+    // The request being answered, while its reply is unfinished. Until
+    // a builder has its model, _waiting is set and _model is NULL.
+    shared_ptr<SentenceModel> _model;
+    uint32_t _owed;     // Sentences still to generate for it
+    bool _waiting;
+    bool _failed;       // The socket failed, so nothing more can be sent
+
+    Connection(int fd)
+        : _fd(fd), _events(0), _parsed(0), _sent(0), _eof(false), _tooLong(false),
+          _owed(0), _waiting(false), _failed(false) { }
+
+    // How much of _out is waiting to be sent.
+    size_t pending() const { return _out.size() - _sent; }
+};
+
+struct EventLoop;
+
+// A model one connection is waiting on.
+struct Build {
+    string _name;
+    EventLoop* _loop;
+    Connection* _conn;
+};
+
+// Models the event loops want built, waiting for a builder thread.
+struct BuildQueue {
+    mutex _lock;
+    condition_variable _ready;
+    deque<Build> _builds;
+    bool _stopping;
+
+    BuildQueue() : _stopping(false) { }
+};
+
+// One event loop's state that other threads can get at: builders hand
+// it each waiting connection's model (NULL if there's no such model)
+// and write to _wake so it looks.
+struct EventLoop {
+    int _listener;
+    int _epoll;
+    int _wake;
+    BuildQueue& _builds;
+    mutex _lock;        // Guards _built
+    vector<pair<Connection*, shared_ptr<SentenceModel> > > _built;
+
+    EventLoop(int listener, BuildQueue& builds)
+        : _listener(listener), _epoll(epoll_create1(EPOLL_CLOEXEC)),
+          _wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), _builds(builds) { }
+
+    ~EventLoop() {
+        close(_epoll);
+        close(_wake);
+    }
+};
+
+//======================================================================
+// SentenceServer
+//
+
+// ModelCache& _models;
+// uint16_t _port;
+// uint32_t _threads;
+
+SentenceServer::SentenceServer(ModelCache& models, uint16_t port, uint32_t threads)
+    : _models(models), _port(port), _threads(max(1u, threads)) { }
+
+bool SentenceServer::run() const {
+    // Every loop gets its own listening socket on the same port, and the
+    // kernel spreads new connections across them
+    vector<int> listeners;
+    uint32_t i;
+    for (i = 0; i < _threads; ++i) {
+        int fd = listen();
+        if (fd < 0) {
+            for (i = 0; i < listeners.size(); ++i) {
+                close(listeners[i]);
+            }
+            return false;
+        }
+        listeners.push_back(fd);
+    }
+
+    // Models are built on threads of their own, so no loop stalls
+    BuildQueue builds;
+    vector<unique_ptr<EventLoop> > loops;
+    for (i = 0; i < listeners.size(); ++i) {
+        loops.push_back(unique_ptr<EventLoop>(new EventLoop(listeners[i], builds)));
+    }
+    vector<thread> builders;
+    for (i = 0; i < _threads; ++i) {
+        builders.push_back(thread(&SentenceServer::builder, this, ref(builds)));
+    }
+    vector<thread> pool;
+    for (i = 1; i < loops.size(); ++i) {
+        pool.push_back(thread(&SentenceServer::loop, this, ref(*loops[i])));
+    }
+    loop(*loops[0]);
+    for (i = 0; i < pool.size(); ++i) {
+        pool[i].join();
+    }
+
+    {
+        lock_guard<mutex> lock(builds._lock);
+        builds._stopping = true;
+    }
+    builds._ready.notify_all();
+    for (i = 0; i < builders.size(); ++i) {
+        builders[i].join();
+    }
+    for (i = 0; i < listeners.size(); ++i) {
+        close(listeners[i]);
+    }
+    return true;
+}
+
+int SentenceServer::listen() const {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int on = 1;
+    int off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(_port);
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(fd, SOMAXCONN) != 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void SentenceServer::loop(EventLoop& loop) const {
+    if (loop._epoll < 0 || loop._wake < 0) {
+        perror("epoll_create1");
+        return;
+    }
+
+    // The listener and the wake-up descriptor are the registrations
+    // without a connection
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(loop._epoll, EPOLL_CTL_ADD, loop._listener, &event);
+    event.data.ptr = &loop;
+    epoll_ctl(loop._epoll, EPOLL_CTL_ADD, loop._wake, &event);
+
+    // Held in reserve for when the process runs out of descriptors
+    int spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    Xoshiro256 random(random_device{}());
+    struct epoll_event events[kMaxEvents];
+    while (true) {
+        int ready = epoll_wait(loop._epoll, events, kMaxEvents, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        // Finished builds are picked up after the other events, since
+        // resuming a connection may close it, and it may have one of them
+        bool woken = false;
+        int e;
+        for (e = 0; e < ready; ++e) {
+            if (events[e].data.ptr == NULL) {
+                accept(loop._listener, loop._epoll, spare);
+                continue;
+            }
+            if (events[e].data.ptr == &loop) {
+                woken = true;
+                continue;
+            }
+
+            // A waiting connection whose client hung up can't be closed
+            // until its build is done, but needn't hear from epoll again
+            Connection* conn = static_cast<Connection*>(events[e].data.ptr);
+            if ((events[e].events & EPOLLERR) ||
+                (conn->_waiting && (events[e].events & EPOLLHUP))) {
+                epoll_ctl(loop._epoll, EPOLL_CTL_DEL, conn->_fd, NULL);
+                fail(*conn);
+            } else {
+                serve(*conn, loop, random);
+            }
+            settle(loop, conn);
+        }
+        if (woken) {
+            resume(loop, random);
+        }
+    }
+    if (spare >= 0) {
+        close(spare);
+    }
+}
+
+// Starts answering each connection whose model a builder has finished
+// with, or tells it there's no such model.
+void SentenceServer::resume(EventLoop& loop, Xoshiro256& random) const {
+    uint64_t wakes;
+    while (read(loop._wake, &wakes, sizeof(wakes)) > 0) { }
+
+    vector<pair<Connection*, shared_ptr<SentenceModel> > > built;
+    {
+        lock_guard<mutex> lock(loop._lock);
+        built.swap(loop._built);
+    }
+    size_t i;
+    for (i = 0; i < built.size(); ++i) {
+        Connection* conn = built[i].first;
+        conn->_waiting = false;
+        if (!conn->_failed) {
+            if (built[i].second) {
+                conn->_out += "OK " + to_string(conn->_owed) + "\n";
+                conn->_model = built[i].second;
+            } else {
+                conn->_out += "ERR no such model\n";
+                conn->_owed = 0;
+            }
+            serve(*conn, loop, random);
+        }
+        settle(loop, conn);
+    }
+}
+
+// Closes conn once the client has stopped sending and has been sent
+// everything it asked for, and otherwise has epoll watch for what it
+// needs next.
+void SentenceServer::settle(EventLoop& loop, Connection* conn) const {
+    bool pending = conn->pending() != 0;
+    if (conn->_waiting) {
+        // Its builder still holds it
+    } else if (conn->_failed || (conn->_eof && !pending)) {
+        close(conn->_fd);
+        delete conn;
+        return;
+    }
+    if (conn->_failed) {
+        return;
+    }
+
+    // Stop reading while the client is behind on replies, or waiting on
+    // a build, so its unanswered requests can't pile up
+    uint32_t wanted = 0;
+    if (pending) {
+        wanted |= EPOLLOUT;
+    }
+    if (!conn->_eof && !conn->_waiting && conn->pending() < kMaxPendingBytes) {
+        wanted |= EPOLLIN;
+    }
+    if (wanted != conn->_events) {
+        struct epoll_event event;
+        conn->_events = wanted;
+        event.events = wanted;
+        event.data.ptr = conn;
+        epoll_ctl(loop._epoll, EPOLL_CTL_MOD, conn->_fd, &event);
+    }
+}
+
+// Builds the models the event loops queue, for as long as the server
+// runs, and hands each back to the loop that asked for it.
+void SentenceServer::builder(BuildQueue& builds) const {
+    while (true) {
+        Build build;
+        {
+            unique_lock<mutex> lock(builds._lock);
+            builds._ready.wait(lock, [&]() { return builds._stopping || !builds._builds.empty(); });
+            if (builds._builds.empty()) {
+                return;
+            }
+            build = builds._builds.front();
+            builds._builds.pop_front();
+        }
+
+        shared_ptr<SentenceModel> sb = _models.get(build._name);
+        EventLoop& loop = *build._loop;
+        {
+            lock_guard<mutex> lock(loop._lock);
+            loop._built.push_back(pair<Connection*, shared_ptr<SentenceModel> >(build._conn, sb));
+        }
+        uint64_t one = 1;
+        if (write(loop._wake, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+}
+
+// Gives up on sending to conn after its socket fails.
+void SentenceServer::fail(Connection& conn) const {
+    conn._failed = true;
+    conn._eof = true;
+    conn._in.clear();
+    conn._out.clear();
+    conn._sent = 0;
+    conn._model.reset();
+    if (!conn._waiting) {
+        conn._owed = 0;
+    }
+}
+
+// Takes every connection that's waiting on listener and adds it to
+// epoll. A connection there's no descriptor for is closed as soon as
+// it's taken, using spare, since epoll would otherwise keep reporting it
+// and the loop would spin.
+void SentenceServer::accept(int listener, int epoll, int& spare) const {
+    while (true) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            Connection* conn = new Connection(fd);
+            conn->_events = EPOLLIN;
+            struct epoll_event event;
+            event.events = conn->_events;
+            event.data.ptr = conn;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM) {
+            // EAGAIN: every waiting connection has been taken
+            return;
+        }
+
+        if (spare < 0) {
+            // Nothing to refuse it with; let the rest of the loop run
+            // for a while before trying again
+            this_thread::sleep_for(chrono::milliseconds(kAcceptBackoffMillis));
+            return;
+        }
+        close(spare);
+        fd = ::accept(listener, NULL, NULL);
+        if (fd >= 0) {
+            close(fd);
+        }
+        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+    }
+}
+
+// Answers every complete request the client has sent, reading more as
+// the socket allows, and sends as much of the replies as it will take.
+// Replies to pipelined requests are batched into as few sends as
+// possible.
+void SentenceServer::serve(Connection& conn, EventLoop& loop, Xoshiro256& random) const {
+    char buffer[64 << 10];
+    while (true) {
+        // Finish the reply in progress, then handle each complete line,
+        // unless the client is too far behind
+        answer(conn, random);
+        size_t newline;
+        while (conn._owed == 0 && conn.pending() < kMaxPendingBytes &&
+               (newline = conn._in.find('\n', conn._parsed)) != string::npos) {
+            string_view line(conn._in.data() + conn._parsed, newline - conn._parsed);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (line.size() > kMaxRequestBytes) {
+                conn._out += "ERR request too long\n";
+            } else if (!line.empty()) {
+                handle(line, conn, loop, random);
+            }
+            conn._parsed = newline + 1;
+        }
+        conn._in.erase(0, conn._parsed);
+        conn._parsed = 0;
+
+        // Only the unfinished line counts against the limit. Complete
+        // requests waiting on the client ahead of it are still answered,
+        // and then the connection ends.
+        size_t last = conn._in.rfind('\n');
+        size_t partial = last == string::npos ? conn._in.size() : conn._in.size() - last - 1;
+        if (partial > kMaxRequestBytes) {
+            conn._in.resize(conn._in.size() - partial);
+            conn._tooLong = true;
+            conn._eof = true;
+        }
+        if (conn._tooLong && conn._in.empty() && conn._owed == 0) {
+            conn._out += "ERR request too long\n";
+            conn._tooLong = false;
+        }
+
+        // Requests that waited on the client are answered as soon as it
+        // catches up, without waiting for it to send more
+        flush(conn);
+        if (conn.pending() >= kMaxPendingBytes) {
+            break;
+        }
+        if (conn._waiting) {
+            break;
+        }
+        if (conn._owed != 0 || conn._in.find('\n') != string::npos) {
+            continue;
+        }
+        if (conn._eof) {
+            break;
+        }
+
+        ssize_t got = read(conn._fd, buffer, sizeof(buffer));
+        if (got > 0) {
+            conn._in.append(buffer, got);
+        } else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+            // Answer whatever complete requests are left, then finish
+            conn._eof = true;
+        } else if (errno == EAGAIN) {
+            break;
+        }
+    }
+}
+
+void SentenceServer::flush(Connection& conn) const {
+    while (conn._sent < conn._out.size()) {
+        ssize_t put = send(conn._fd, conn._out.data() + conn._sent,
+                           conn._out.size() - conn._sent, MSG_NOSIGNAL);
+        if (put < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                // The client is gone; drop what it didn't get
+                fail(conn);
+            }
+            break;
+        }
+        conn._sent += put;
+    }
+    if (conn._sent == conn._out.size()) {
+        conn._out.clear();
+        conn._sent = 0;
+    }
+}
+
+void SentenceServer::handle(string_view request, Connection& conn, EventLoop& loop,
+                            Xoshiro256& random) const {
+    string model(request.substr(0, request.find(',')));
+    uint32_t count = 1;
+    if (model.size() < request.size()) {
+        string number(request.substr(model.size() + 1));
+        char* end;
+        unsigned long parsed = strtoul(number.c_str(), &end, 10);
+        if (number.empty() || *end != '\0' || parsed == 0 || parsed > kMaxCount) {
+            conn._out += "ERR count must be between 1 and " + to_string(kMaxCount) + "\n";
+            return;
+        }
+        count = parsed;
+    }
+
+    // Holding the model keeps it alive even if the cache drops it
+    conn._owed = count;
+    conn._model = _models.find(model);
+    if (!conn._model) {
+        // Anything else is up to a builder, and this connection waits for
+        // it, but the loop's other connections don't
+        conn._waiting = true;
+        {
+            lock_guard<mutex> lock(loop._builds._lock);
+            Build build = { model, &loop, &conn };
+            loop._builds._builds.push_back(build);
+        }
+        loop._builds._ready.notify_one();
+        return;
+    }
+    conn._out += "OK " + to_string(count) + "\n";
+    answer(conn, random);
+}
+
+// Generates the rest of the reply in progress, a chunk at a time, until
+// it's done or the client is too far behind.
+void SentenceServer::answer(Connection& conn, Xoshiro256& random) const {
+    WalkLimits limits;
+    limits._softWords = kSoftWords;
+    limits._maxWords = kMaxWords;
+    while (conn._model && conn._owed != 0 && conn.pending() < kMaxPendingBytes) {
+        uint32_t chunk = min(conn._owed, kChunkSentences);
+        conn._model->buildSentences(chunk, random, conn._out, limits);
+        conn._owed -= chunk;
+    }
+    if (conn._model && conn._owed == 0) {
+        conn._model.reset();
+    }
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+#include "ModelCache.h"
+#include "SentenceServer.h"
+
+void usage();
+size_t number(const char* text, size_t most);
+bool findFiles(const string& root, const string& extension, size_t maxBytes, uint32_t readers,
+               const function<void(const string&)>& found);
+
+int main(int argc, char* argv[]) {
+    // -p port serves sentences over TCP instead of prompting for models.
+    // -m megabytes keeps at most about that much of the models in
+    // memory, building each one only once it's asked for.
+    // -e extension and -s kilobytes choose which files under the
+    // directory are texts: those ending in extension (.txt unless
+    // given), and no larger than that if given.
+    // -t kind chooses the kind of model: graph (the default); compact,
+    // for a smaller one; backoff, which says short sentences whole; or
+    // suffix, which does too, in memory in proportion to the text. Only
+    // graphs can be blended.
+    uint16_t port = 0;
+    size_t budget = 0;
+    string extension = ".txt";
+    size_t maxBytes = 0;
+    ModelKind kind = kGraphModel;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:e:s:t:")) != -1) {
+        if (opt == 't' && strcmp(optarg, "graph") == 0) {
+            kind = kGraphModel;
+        } else if (opt == 't' && strcmp(optarg, "compact") == 0) {
+            kind = kCompactModel;
+        } else if (opt == 't' && strcmp(optarg, "backoff") == 0) {
+            kind = kBackoffModel;
+        } else if (opt == 't' && strcmp(optarg, "suffix") == 0) {
+            kind = kSuffixModel;
+        } else if (opt == 'p') {
+            port = number(optarg, UINT16_MAX);
+        } else if (opt == 'm') {
+            budget = number(optarg, SIZE_MAX >> 20) << 20;
+        } else if (opt == 'e') {
+            extension = optarg;
+        } else if (opt == 's') {
+            maxBytes = number(optarg, SIZE_MAX >> 10) << 10;
+        } else {
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 2 && argc != 3) usage();
+
+    uint32_t gramSize = atoi(argv[0]);
+    string dirName = argv[1];
+    if (gramSize == 0) usage();
+    string snapshotDir = argc == 3 ? argv[2] : "";
+
+    // Maps from token (such as "hugo" or "kafka") to corresponding
+    // model.
+    ModelCache builders(gramSize, snapshotDir, budget, kind);
+
+    // Model names are the files' paths under the directory without
+    // their extension. Without a budget, each model is
+    // constructed as soon as its file is found, one per core at a time,
+    // while the rest of the directory is still being read.
+    atomic<size_t> found(0);
+    vector<string> constructed;
+    mutex reportLock;
+    if (budget == 0) {
+        cout << "Constructing models" << endl;
+    }
+    bool listed = findFiles(dirName, extension, maxBytes, thread::hardware_concurrency(),
+                            [&](const string& path) {
+        string name = path.substr(0, path.size() - extension.size());
+        builders.add(name, dirName + "/" + path);
+        ++found;
+        if (budget != 0) {
+            return;
+        }
+        builders.get(name);
+
+        lock_guard<mutex> lock(reportLock);
+        constructed.push_back(name);
+    });
+    if (!listed) usage();
+
+    // Reported in name order, however the builds happened to finish, so
+    // the output reads the same every run. Until the whole directory has
+    // been read, a model that sorts first might still turn up, so this
+    // waits for the lot.
+    if (budget == 0) {
+        sort(constructed.begin(), constructed.end());
+        size_t i;
+        for (i = 0; i < constructed.size(); ++i) {
+            cout << "Constructed model " << constructed[i]
+                 << " (" << i + 1 << "/" << constructed.size() << ")" << endl;
+        }
+        cout << endl;
+    }
+
+    if (port != 0) {
+        cout << "Serving " << found << " models on port " << port << endl;
+        SentenceServer server(builders, port, thread::hardware_concurrency());
+        return server.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Prompt user for input
+    Xoshiro256 random(random_device{}());
+    do {
+        string model;
+        
+        cout << "Enter model name to generate sentence using that model," << endl;
+        cout << "list for a list of models, stats and a model name for its" << endl;
+        cout << "statistics, or exit to exit: ";
+        if (!(cin >> model) || model == "exit") {
+            break;
+        }
+
+        if (model == "stats") {
+            string name;
+            if (!(cin >> name)) {
+                break;
+            }
+            shared_ptr<SentenceModel> sb(builders.get(name));
+            if (!sb) {
+                cout << endl << "\tNo model named " << name << endl << endl;
+                continue;
+            }
+            stringstream lines(sb->describe());
+            string line;
+            cout << endl;
+            while (getline(lines, line)) {
+                cout << "\t" << line << endl;
+            }
+            cout << endl;
+            continue;
+        }
+
+        if (model == "list") {
+            vector<string> models = builders.names();
+            uint32_t i;
+            cout << endl;
+            for (i = 0; i < models.size(); ++i) {
+                cout << "\t" << models[i] << endl;
+            }
+            cout << endl << "\t(" << builders.loaded() << " in memory, "
+                 << (builders.bytes() >> 10) << " KiB)" << endl << endl;
+            continue;
+        }
+
+        shared_ptr<SentenceModel> sb(builders.get(model));
+        if (!sb) {
+            cout << endl << "\tNo model named " << model << endl << endl;
+            continue;
+        }
+
+        // Written to cout as it's generated, straight from the model
+        cout << endl << "\t";
+        sb->writeSentence(random, [](string_view word) {
+            cout << word << ' ';
+        });
+        cout << endl << endl;
+        
+    } while(true);
+
+    return EXIT_SUCCESS;
+}
+
+// Lists one directory under root for findFiles(), adding its
+// subdirectories to dirs and its texts to files, as paths relative to
+// root. Subdirectories that are symbolic links aren't followed, so
+// there's no going round in circles.
+static void readDirectory(const string& root, const string& dir, const string& extension,
+                          size_t maxBytes, vector<string>& dirs, vector<string>& files) {
+    DIR* dirPtr = opendir(dir.empty() ? root.c_str() : (root + "/" + dir).c_str());
+    if (dirPtr == NULL) {
+        return;
+    }
+
+    struct dirent* dirp;
+    while ((dirp = readdir(dirPtr)) != NULL) {
+        string name(dirp->d_name);
+        if (name == ".." || name == ".") {
+            continue;
+        }
+        string path = dir.empty() ? name : dir + "/" + name;
+
+        struct stat info;
+        bool isDir = dirp->d_type == DT_DIR;
+        if (dirp->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dirPtr), dirp->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            isDir = S_ISDIR(info.st_mode);
+        }
+        if (isDir) {
+            dirs.push_back(path);
+            continue;
+        }
+
+        if (name.size() <= extension.size() ||
+            name.compare(name.size() - extension.size(), extension.size(), extension) != 0) {
+            continue;
+        }
+        if (fstatat(dirfd(dirPtr), dirp->d_name, &info, 0) != 0 || !S_ISREG(info.st_mode) ||
+            (maxBytes != 0 && static_cast<size_t>(info.st_size) > maxBytes)) {
+            continue;
+        }
+        files.push_back(path);
+    }
+
+    closedir(dirPtr);
+}
+
+// Finds the regular files under root, however deeply, whose names end
+// in extension and that are at most maxBytes long (any length if
+// maxBytes is 0), by reading directories on several threads at once.
+// Calls found with each one's path relative to root as it turns up, on
+// one of those threads, so found may be called on several threads at
+// once; while it runs, the other threads carry on. Returns false if
+// root can't be read.
+bool findFiles(const string& root, const string& extension, size_t maxBytes, uint32_t readers,
+               const function<void(const string&)>& found) {
+    DIR* dirPtr = opendir(root.c_str());
+    if (dirPtr == NULL) {
+        return false;
+    }
+    closedir(dirPtr);
+
+    // Directories not yet read and files not yet passed to found, and
+    // how many threads are reading a directory. Once all three are none,
+    // there's nothing left to find. Threads read directories before
+    // handling files, so that everyone has files to handle sooner.
+    mutex lock;
+    condition_variable changed;
+    vector<string> dirs(1, "");
+    vector<string> files;
+    uint32_t reading = 0;
+
+    auto reader = [&]() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [&]() {
+                return !dirs.empty() || !files.empty() || reading == 0;
+            });
+            if (!dirs.empty()) {
+                string dir = dirs.back();
+                dirs.pop_back();
+                ++reading;
+                guard.unlock();
+
+                vector<string> foundDirs, foundFiles;
+                readDirectory(root, dir, extension, maxBytes, foundDirs, foundFiles);
+
+                guard.lock();
+                dirs.insert(dirs.end(), foundDirs.begin(), foundDirs.end());
+                files.insert(files.end(), foundFiles.begin(), foundFiles.end());
+                --reading;
+                changed.notify_all();
+            } else if (!files.empty()) {
+                string file = files.back();
+                files.pop_back();
+                guard.unlock();
+                found(file);
+                guard.lock();
+            } else {
+                return;
+            }
+        }
+    };
+
+    // Each reader gives its thread back as soon as it runs out of work,
+    // for the builds still going on the others to use
+    vector<thread> pool;
+    uint32_t t;
+    uint32_t helpers = claimThreads(max(1u, readers) - 1);
+    for (t = 0; t < helpers; ++t) {
+        pool.push_back(thread([&]() {
+            reader();
+            releaseThreads(1);
+        }));
+    }
+    reader();
+    for (t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+    return true;
+}
+
+void usage() {
+    cerr << "Usage: ./soln_ex12 [-p port] [-m megabytes] [-e extension] [-s kilobytes]" << endl;
+    cerr << "                   [-t graph|compact|backoff|suffix]" << endl;
+    cerr << "                   N directoryname [snapshotdirectory]" << endl;
+    exit(EXIT_FAILURE);
+}
+
+// Returns the number spelled by text, which must be all digits and
+// between 1 and most, or else exits through usage().
+size_t number(const char* text, size_t most) {
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (!isdigit(static_cast<unsigned char>(text[0])) || *end != '\0' || errno != 0 ||
+        parsed == 0 || parsed > most) {
+        usage();
+    }
+    return parsed;
+}
+
+
+
+
+
+/* ------------------------------------------------- */
+
+
+
+
+
+// Measures how sentence generation scales with the number of threads
+// sharing one SentenceBuilder, or, as "suite", how fast each kind of
+// model builds and generates on synthetic texts of several sizes, or,
+// as "compact", what compacting a model saves and what it gives up.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+#include "SentenceBuilder.h"
+#include "BackoffModel.h"
+#include "SuffixModel.h"
+#include "CompactModel.h"
+
+// Sentences each thread generates per call to buildSentences.
+static const size_t kBatchSize = 1000;
+
+// The synthetic texts: word frequencies follow Zipf's law with this
+// exponent over this many distinct words, and sentences run from
+// kShortest to kLongest words.
+static const uint32_t kVocabulary = 50000;
+static const double kZipfExponent = 1.1;
+static const uint32_t kShortest = 4;
+static const uint32_t kLongest = 30;
+
+// Sentences each latency measurement times, one at a time.
+static const uint32_t kLatencySamples = 20000;
+
+// How the "bounded" engine, a graph model, limits its walks: it heads
+// for an end once a sentence is as long as the texts' longest or has
+// taken kBoundedMicros, and stops at four times that length.
+static const uint32_t kBoundedSoftWords = kLongest;
+static const uint32_t kBoundedMaxWords = 4 * kLongest;
+static const uint32_t kBoundedMicros = 20;
+
+// How the "compact" engine compacts a graph model.
+static const uint32_t kCompactMinCount = 2;
+static const uint32_t kCompactWeightBits = 8;
+
+// How long "compact" generates from each model to time it.
+static const double kCompactSeconds = 0.25;
+
+double sentencesPerSecond(const SentenceBuilder& sb, uint32_t threads, double seconds);
+int scaling(int argc, char* argv[]);
+int suite(int argc, char* argv[]);
+int tradeoff(char* argv[]);
+string writeCorpus(uint64_t tokens);
+void measure(const string& engine, const string& filename, uint64_t tokens, uint32_t n);
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "suite") == 0) {
+        return suite(argc - 2, argv + 2);
+    }
+    if (argc == 4 && strcmp(argv[1], "compact") == 0) {
+        return tradeoff(argv + 2);
+    }
+    if (argc != 3 && argc != 4) {
+        cerr << "Usage: ./ex12bench N filename [seconds]" << endl;
+        cerr << "       ./ex12bench suite [tokens ...]" << endl;
+        cerr << "       ./ex12bench compact N filename" << endl;
+        return EXIT_FAILURE;
+    }
+    return scaling(argc, argv);
+}
+
+int scaling(int argc, char* argv[]) {
+    uint32_t gramSize = atoi(argv[1]);
+    string filename = argv[2];
+    double seconds = argc == 4 ? atof(argv[3]) : 1.0;
+    if (gramSize == 0) {
+        cerr << "N must be at least 1" << endl;
+        return EXIT_FAILURE;
+    }
+
+    SentenceBuilder sb(filename, gramSize);
+
+    // Up to twice the core count, to show where scaling flattens out
+    uint32_t cores = max(1u, thread::hardware_concurrency());
+    double single = 0;
+    uint32_t threads;
+    cout << "threads  sentences/s  speedup" << endl;
+    for (threads = 1; threads <= 2 * cores; threads *= 2) {
+        double rate = sentencesPerSecond(sb, threads, seconds);
+        if (threads == 1) {
+            single = rate;
+        }
+        cout << setw(7) << threads << "  " << setw(11) << fixed << setprecision(0) << rate
+             << "  " << setw(6) << setprecision(2) << rate / single << "x" << endl;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Runs threads generators against sb for about the given number of
+// seconds and returns the total number of sentences they produced per
+// second.
+double sentencesPerSecond(const SentenceBuilder& sb, uint32_t threads, double seconds) {
+    atomic<bool> stop(false);
+    atomic<uint64_t> total(0);
+
+    vector<thread> pool;
+    uint32_t t;
+    for (t = 0; t < threads; ++t) {
+        pool.push_back(thread([&, t]() {
+            Xoshiro256 random(t + 1);
+            string out;
+            uint64_t count = 0;
+            while (!stop.load(memory_order_relaxed)) {
+                out.clear();
+                sb.buildSentences(kBatchSize, random, out);
+                count += kBatchSize;
+            }
+            total += count;
+        }));
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    stop = true;
+    for (t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    return total / elapsed.count();
+}
+
+// Compacts the model for a file with each of several pruning thresholds
+// and weight sizes, and prints what each costs and how faithful it is.
+int tradeoff(char* argv[]) {
+    uint32_t gramSize = atoi(argv[0]);
+    string filename = argv[1];
+    if (gramSize == 0) {
+        cerr << "N must be at least 1" << endl;
+        return EXIT_FAILURE;
+    }
+
+    shared_ptr<SentenceBuilder> sb = SentenceBuilder::create(filename, gramSize);
+    double full = sb->memoryUsage();
+    cout << "graph: " << sb->gramCount() << " grams, " << sb->edgeCount() << " edges, "
+         << static_cast<size_t>(full) / 1024 << " KiB" << endl << endl;
+
+    const uint32_t minCounts[] = { 1, 2, 3, 5, 10 };
+    const uint32_t weightBits[] = { 16, 8 };
+    cout << "min  bits      grams      edges        KiB  of graph  fidelity  sentences/s" << endl;
+    uint32_t c, b;
+    for (c = 0; c < sizeof(minCounts) / sizeof(minCounts[0]); ++c) {
+        for (b = 0; b < sizeof(weightBits) / sizeof(weightBits[0]); ++b) {
+            CompactOptions options;
+            options._minCount = minCounts[c];
+            options._weightBits = weightBits[b];
+            CompactModel compact(*sb, options);
+
+            Xoshiro256 random(c << 8 | b);
+            string out;
+            uint64_t sentences = 0;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            chrono::duration<double> elapsed;
+            do {
+                out.clear();
+                compact.buildSentences(kBatchSize, random, out);
+                sentences += kBatchSize;
+                elapsed = chrono::steady_clock::now() - start;
+            } while (elapsed.count() < kCompactSeconds);
+
+            double bytes = compact.memoryUsage();
+            cout << setw(3) << minCounts[c] << setw(6) << weightBits[b]
+                 << setw(11) << compact.gramCount() << setw(11) << compact.edgeCount()
+                 << setw(11) << static_cast<size_t>(bytes) / 1024
+                 << setw(9) << fixed << setprecision(1) << 100 * bytes / full << "%"
+                 << setw(10) << setprecision(4) << compact.fidelity()
+                 << setw(13) << setprecision(0) << sentences / elapsed.count() << endl;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Builds every kind of model for n = 1 to 5 over texts of each size
+// (100 thousand, 1 million and 3 million tokens unless given), one
+// process per model so each one's peak RSS is its own.
+int suite(int argc, char* argv[]) {
+    vector<uint64_t> sizes;
+    int i;
+    for (i = 0; i < argc; ++i) {
+        sizes.push_back(strtoull(argv[i], NULL, 10));
+        if (sizes.back() == 0) {
+            cerr << "Sizes are numbers of tokens" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (sizes.empty()) {
+        sizes.push_back(100000);
+        sizes.push_back(1000000);
+        sizes.push_back(3000000);
+    }
+
+    const char* engines[] = { "graph", "bounded", "compact", "backoff", "suffix" };
+    cout << "engine    n     tokens  build tok/s  bytes/tok  bytes/gram"
+         << "  p50 ns  p99 ns  peak RSS KiB" << endl;
+    uint32_t s;
+    for (s = 0; s < sizes.size(); ++s) {
+        string filename = writeCorpus(sizes[s]);
+        if (filename.empty()) {
+            cerr << "Couldn't write a corpus" << endl;
+            return EXIT_FAILURE;
+        }
+
+        uint32_t e, n;
+        for (e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+            for (n = 1; n <= 5; ++n) {
+                cout.flush();
+                pid_t child = fork();
+                if (child == 0) {
+                    measure(engines[e], filename, sizes[s], n);
+                    cout.flush();
+                    _exit(EXIT_SUCCESS);
+                }
+                int status;
+                waitpid(child, &status, 0);
+            }
+        }
+        unlink(filename.c_str());
+    }
+    return EXIT_SUCCESS;
+}
+
+// Writes a text of tokens words to a temporary file and returns its
+// name, or "" if it can't. The same size always gets the same text.
+string writeCorpus(uint64_t tokens) {
+    // The rank r word is drawn with probability proportional to
+    // 1 / r^kZipfExponent, by searching the running totals
+    vector<double> cumulative(kVocabulary);
+    double total = 0;
+    uint32_t r;
+    for (r = 0; r < kVocabulary; ++r) {
+        total += 1 / pow(r + 1, kZipfExponent);
+        cumulative[r] = total;
+    }
+
+    // Spell each rank as letters, so common words are short ones
+    vector<string> words(kVocabulary);
+    for (r = 0; r < kVocabulary; ++r) {
+        uint32_t k = r;
+        do {
+            words[r] += static_cast<char>('a' + k % 26);
+            k /= 26;
+        } while (k != 0);
+    }
+
+    char filename[] = "/tmp/ex12benchXXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0) {
+        return "";
+    }
+    close(fd);
+
+    ofstream out(filename, ios::out | ios::binary | ios::trunc);
+    Xoshiro256 random(tokens);
+    string line;
+    uint64_t written = 0;
+    while (written < tokens) {
+        uint32_t length = kShortest + random.below(kLongest - kShortest + 1);
+        line.clear();
+        uint32_t w;
+        for (w = 0; w < length && written < tokens; ++w, ++written) {
+            double x = (random.next() >> 11) * 0x1.0p-53 * total;
+            r = lower_bound(cumulative.begin(), cumulative.end(), x) - cumulative.begin();
+            line += words[min(r, kVocabulary - 1)];
+            line += w + 1 == length ? ". " : " ";
+        }
+        line += '\n';
+        out << line;
+    }
+    out.close();
+    if (out.fail()) {
+        unlink(filename);
+        return "";
+    }
+    return filename;
+}
+
+// Returns the p-th percentile of sorted.
+static double percentile(const vector<double>& sorted, double p) {
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+// Builds one model of the given engine, times generating sentences from
+// it one at a time, and prints a row of the suite's table.
+void measure(const string& engine, const string& filename, uint64_t tokens, uint32_t n) {
+    shared_ptr<SentenceBuilder> graph;
+    shared_ptr<BackoffModel> backoff;
+    shared_ptr<SuffixModel> suffix;
+    shared_ptr<CompactModel> compact;
+    string name = filename;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t bytes;
+    if (engine == "graph" || engine == "bounded") {
+        graph = SentenceBuilder::create(name, n);
+        bytes = graph->memoryUsage();
+    } else if (engine == "compact") {
+        CompactOptions options;
+        options._minCount = kCompactMinCount;
+        options._weightBits = kCompactWeightBits;
+        compact = make_shared<CompactModel>(name, n, options);
+        bytes = compact->memoryUsage();
+    } else if (engine == "backoff") {
+        backoff = make_shared<BackoffModel>(name, n);
+        bytes = backoff->memoryUsage();
+    } else {
+        suffix = make_shared<SuffixModel>(name, n);
+        bytes = suffix->memoryUsage();
+    }
+    chrono::duration<double> built = chrono::steady_clock::now() - start;
+
+    WalkLimits limits;
+    if (engine == "bounded") {
+        limits._softWords = kBoundedSoftWords;
+        limits._maxWords = kBoundedMaxWords;
+    }
+
+    vector<double> latencies(kLatencySamples);
+    uint32_t i;
+    for (i = 0; i < kLatencySamples; ++i) {
+        chrono::steady_clock::time_point before = chrono::steady_clock::now();
+        if (engine == "bounded") {
+            limits._deadline = before + chrono::microseconds(kBoundedMicros);
+        }
+        string sentence = graph ? graph->buildSentence(limits) :
+                          compact ? compact->buildSentence() :
+                          backoff ? backoff->buildSentence(n) : suffix->buildSentence();
+        chrono::duration<double, nano> took = chrono::steady_clock::now() - before;
+        latencies[i] = took.count();
+    }
+    sort(latencies.begin(), latencies.end());
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    cout << left << setw(8) << engine << right << setw(3) << n << setw(11) << tokens
+         << setw(13) << fixed << setprecision(0) << tokens / built.count()
+         << setw(11) << setprecision(1) << static_cast<double>(bytes) / tokens;
+    if (graph) {
+        cout << setw(12) << static_cast<double>(bytes) / max<uint64_t>(1, graph->gramCount());
+    } else if (compact) {
+        cout << setw(12) << static_cast<double>(bytes) / max<uint64_t>(1, compact->gramCount());
+    } else {
+        cout << setw(12) << "-";
+    }
+    cout << setw(8) << setprecision(0) << percentile(latencies, 0.5)
+         << setw(8) << percentile(latencies, 0.99)
+         << setw(14) << usage.ru_maxrss << endl;
 }